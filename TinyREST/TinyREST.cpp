@@ -1,6 +1,3 @@
-#include <WiServer.h>
-#include <WProgram.h>
-#include <EEPROM.h>
 #include <stdio.h>
 
 #include "TinyREST.h"
@@ -8,23 +5,60 @@
 // The following structure contains the data necessary to perform the
 // REST callbacks whenever a value is changing (and when there is a 
 // watch for that value!). It binds the return path for the URL and the
-// server declared with addServer().
+// server declared with addServer().  A watch can have several of these
+// destinations, they all are kept in the same list and point back at
+// their watch through its handle, so that one sample of the value can
+// feed several servers.
 #ifdef HAVE_SUBSCRIBE
-#define MAXPATH (48)
 struct cb_info {
   char path[MAXPATH];
+  vwatch_handle_t watch;  // Watch that this is a destination of
   uint8_t srv_id;
+  boolean pending;        // Value still has to be delivered
+  boolean streaming;      // Value is being delivered in a stream
+  int value;              // Value to deliver, the last one seen.
+  int sent;               // Value being delivered in a stream
+  struct cb_info *next;   // Next in list of all subscriptions
 };
+static struct cb_info *cb_list = NULL;
 #endif
 
 
+#ifdef HAVE_STATS
+stats_t TinyREST::stats;
+#endif
+
+#ifdef HAVE_SUBSCRIBE
+// All memory allocations of the library go through these, so that they
+// can be accounted for in the statistics.
+static void *rest_malloc(size_t size) {
+  void *p = malloc(size);
+#ifdef HAVE_STATS
+  if (p != NULL) TinyREST::stats.allocs++;
+#endif
+  return p;
+}
+
+static void rest_free(void *p) {
+#ifdef HAVE_STATS
+  if (p != NULL) TinyREST::stats.frees++;
+#endif
+  free(p);
+}
+#endif
+
 // A set of SDRAM strings for constructing the JSON answers of the
 // server. Most of these are used when returning back the status of the
 // server.
 const char JSON_RESPONSE[] PROGMEM = {"{\"result\":"};
 const char JSON_TRUE[] PROGMEM = { "true}" };
 const char JSON_FALSE[] PROGMEM = { "false}" };
+const char JSON_BUSY[] PROGMEM = { "false,\"busy\":true}" };
+#ifdef HAVE_PERSIST
+const char JSON_UNSAVED[] PROGMEM = { "true,\"saved\":false}" };
+#endif
 
+const char JSON_RAM[] PROGMEM = {"\"ram\":"};
 const char JSON_COMMANDS[] PROGMEM = {"\"commands\":"};
 const char JSON_SHARED[] PROGMEM = {"\"shared\":"};
 const char JSON_COMMAND[] PROGMEM = {"\"command\":"};
@@ -32,13 +66,18 @@ const char JSON_ARGUMENTS[] PROGMEM = {"\"arguments\":"};
 const char JSON_NEXT_VALUE[] PROGMEM = {"\","};
 const char JSON_NEXT_OBJECT[] PROGMEM = {"},"};
 const char JSON_NEXT_ARRAY[] PROGMEM = {"],"};
+const char JSON_NEXT[] PROGMEM = {"\"next\":"};
 #ifdef HAVE_SUBSCRIBE
 const char JSON_WATCHS[] PROGMEM = {"\"subscriptions\":"};
 const char JSON_POSITION[] PROGMEM = {"\"position\":"};
 const char JSON_VALUE[] PROGMEM = {"\"value\":"};
 const char JSON_TYPE[] PROGMEM = {"\"type\":"};
 const char JSON_PATH[] PROGMEM = {"\"path\":\""};
+const char JSON_DESTINATIONS[] PROGMEM = {"\"destinations\":["};
+const char JSON_SERVER[] PROGMEM = {"{\"server\":"};
+const char JSON_END_OBJECT[] PROGMEM = {"\"}"};
 const char JSON_FREQUENCY[] PROGMEM = {"\"frequency\":"};
+const char JSON_RANGE[] PROGMEM = {"\"range\":"};
 const char JSON_TYPE_APIN[] PROGMEM = {"\"apin\","};
 const char JSON_TYPE_DPIN[] PROGMEM = {"\"dpin\","};
 #ifdef HAVE_SHARED
@@ -49,6 +88,42 @@ const char JSON_SERVERS[] PROGMEM = {"\"servers\":"};
 const char JSON_IP[] PROGMEM = {"\"ip\":\""};
 const char JSON_PORT[] PROGMEM = {"\"port\":"};
 const char JSON_ID[] PROGMEM = {"\"id\":"};
+const char JSON_SEQ[] PROGMEM = {"\"seq\":"};
+const char JSON_LOST[] PROGMEM = {"\"lost\":"};
+const char JSON_MODE[] PROGMEM = {"\"mode\":"};
+const char JSON_FAILURES[] PROGMEM = {"\"failures\":"};
+const char JSON_HEALTHY[] PROGMEM = {"\"healthy\":"};
+const char JSON_TRUE_VALUE[] PROGMEM = {"true"};
+const char JSON_FALSE_VALUE[] PROGMEM = {"false"};
+#ifdef HAVE_RULES
+const char JSON_RULES[] PROGMEM = {"\"rules\":"};
+const char JSON_RULE[] PROGMEM = {"\"rule\":\""};
+const char JSON_ACTIVE[] PROGMEM = {"\"active\":"};
+
+// Names of the RULE_ comparisons, two characters each, in order.
+const char rule_ops[] PROGMEM = {"gtlteqne"};
+#endif
+#endif
+
+#ifdef HAVE_STATS
+const char JSON_REQUESTS[] PROGMEM = {"\"requests\":"};
+const char JSON_MAX[] PROGMEM = {"\"max\":"};
+const char JSON_TIMES[] PROGMEM = {"\"times\":"};
+const char JSON_DELIVERED[] PROGMEM = {"\"delivered\":"};
+const char JSON_FAILED[] PROGMEM = {"\"failed\":"};
+const char JSON_DROPPED[] PROGMEM = {"\"dropped\":"};
+const char JSON_ALLOCS[] PROGMEM = {"\"allocs\":"};
+const char JSON_FREES[] PROGMEM = {"\"frees\":"};
+const char JSON_REJECTED[] PROGMEM = {"\"rejected\":"};
+#endif
+
+#ifdef HAVE_MEM
+const char JSON_FREE[] PROGMEM = {"\"free\":"};
+const char JSON_LARGEST[] PROGMEM = {"\"largest\":"};
+const char JSON_STACK[] PROGMEM = {"\"stack\":"};
+const char JSON_DEST_COUNT[] PROGMEM = {"\"destinations\":"};
+const char JSON_RESPONDERS[] PROGMEM = {"\"responders\":"};
+const char JSON_QUEUE[] PROGMEM = {"\"eeprom_queue\":"};
 #endif
 
 // Respond the status of the server, this means the list of commands
@@ -56,153 +131,503 @@ const char JSON_ID[] PROGMEM = {"\"id\":"};
 // currently register, as well as the list of servers for reception
 // of value changes that are known.
 void TinyREST::respond_status() {
-  WiServer.println('{');
+  respond_status(0, 0);
+}
+
+// Same as above, but only for a page of the status.  Commands,
+// subscriptions, servers and rules are numbered one after the other, and
+// only the limit items from offset are sent, all of them when limit
+// is 0.  When there are more items, "next" gives the offset of the
+// next page.  WiServer generates the output again for every segment and
+// retransmission, so the values that change by themselves (values and
+// frequencies of watches, failures of servers and states of rules) are
+// printed from the snapshot taken on the first call.  Commands that
+// add or remove items while the response is sent still change it.
+void TinyREST::respond_status(int offset, int limit) {
+  int item = 0;                   // Number of current item
+  int end = (limit > 0) ? offset + limit : 0x7FFF;
+  boolean first;
+#ifdef HAVE_SUBSCRIBE
+  boolean fresh;
+  snapshot_t *s = takeSnapshot(&fresh);
+  
+  if (s == NULL) {
+    send_busy();
+    return;
+  }
+  if (fresh) {
+    for (int i=0; i<MAX_WATCHS; i++) {
+      s->status.value[i] = this->watchs[i].value;
+      s->status.freq[i] = this->watchs[i].freq;
+    }
+    for (int i=0; i<MAX_SERVERS; i++)
+      s->status.failures[i] = this->servers[i].failures;
+#ifdef HAVE_RULES
+    for (int i=0; i<MAX_RULES; i++)
+      s->status.active[i] = this->rules[i].active;
+#endif
+  }
+#endif
+  
+  REST_OUT.println('{');
+
+  // Static RAM used by the library in this configuration.
+  REST_OUT.print_P(JSON_RAM);
+  sprintf(buffer, "%u,", ramUsage());
+  REST_OUT.println(buffer);
 
   // Send back list of commands supported by the server.
-  WiServer.print_P(JSON_COMMANDS);
-  WiServer.println('[');
+  REST_OUT.print_P(JSON_COMMANDS);
+  REST_OUT.println('[');
+  first = true;
   for (int i=0; i<this->cmd_count;i++) {
-    WiServer.print('{');
-    WiServer.print_P(JSON_COMMAND);
-    WiServer.print('\"');
-    WiServer.print(this->cmds[i].cmd);
-    WiServer.print_P(JSON_NEXT_VALUE);
-    WiServer.print_P(JSON_ARGUMENTS);
-    sprintf(buffer, "%u", this->cmds[i].len);
-    WiServer.print(buffer);
-    if (i<this->cmd_count-1) {
-      WiServer.println_P(JSON_NEXT_OBJECT);
+    if (item++ < offset || item > end)
+      continue;
+    if (!first)
+      REST_OUT.println_P(JSON_NEXT_OBJECT);
+    first = false;
+    REST_OUT.print('{');
+    REST_OUT.print_P(JSON_COMMAND);
+    REST_OUT.print('\"');
+    if (this->cmds[i].flags & CMD_PROGMEM) {
+      REST_OUT.print_P(this->cmds[i].cmd);
     } else {
-      WiServer.println('}');
+      REST_OUT.print(this->cmds[i].cmd);
     }
+    REST_OUT.print_P(JSON_NEXT_VALUE);
+    REST_OUT.print_P(JSON_ARGUMENTS);
+    sprintf(buffer, "%u", this->cmds[i].len);
+    REST_OUT.print(buffer);
   }
+  if (!first)
+    REST_OUT.println('}');
   // Send back the list of subscription and their details
 #ifdef HAVE_SUBSCRIBE
-  WiServer.println_P(JSON_NEXT_ARRAY);
+  REST_OUT.println_P(JSON_NEXT_ARRAY);
   
-  WiServer.print_P(JSON_WATCHS);
-  WiServer.println('[');
-  for (int i=0; i<this->watch_count;i++) {
-    WiServer.print('{');
-    WiServer.print_P(JSON_TYPE);
+  REST_OUT.print_P(JSON_WATCHS);
+  REST_OUT.println('[');
+  first = true;
+  for (int i=0; i<MAX_WATCHS;i++) {
+    if (this->watchs[i].type == VALUE_WATCH_NONE)
+      continue;
+    if (item++ < offset || item > end)
+      continue;
+    if (!first)
+      REST_OUT.println_P(JSON_NEXT_OBJECT);
+    first = false;
+    REST_OUT.print('{');
+    REST_OUT.print_P(JSON_TYPE);
     switch(this->watchs[i].type) {
       case VALUE_WATCH_DPIN:
-        WiServer.print_P(JSON_TYPE_DPIN);
+        REST_OUT.print_P(JSON_TYPE_DPIN);
         break;
       case VALUE_WATCH_APIN:
-        WiServer.print_P(JSON_TYPE_APIN);
+        REST_OUT.print_P(JSON_TYPE_APIN);
         break;
 #ifdef HAVE_SHARED
       case VALUE_WATCH_SHARED:
-        WiServer.print_P(JSON_TYPE_SHARED);
+        REST_OUT.print_P(JSON_TYPE_SHARED);
         break;
 #endif
       case VALUE_WATCH_EEPROM:
-        WiServer.print_P(JSON_TYPE_EEPROM);
+        REST_OUT.print_P(JSON_TYPE_EEPROM);
         break;
     }
-    WiServer.print_P(JSON_POSITION);
+    REST_OUT.print_P(JSON_POSITION);
     sprintf(buffer, "%u,", this->watchs[i].position);
-    WiServer.print(buffer);
-    WiServer.print_P(JSON_FREQUENCY);
-    sprintf(buffer, "%u,", this->watchs[i].freq);
-    WiServer.print(buffer);
-    WiServer.print_P(JSON_PATH);
-    WiServer.print(((struct cb_info *)this->watchs[i].blind)->path);
-    WiServer.print_P(JSON_NEXT_VALUE);
-    WiServer.print_P(JSON_VALUE);
-    sprintf(buffer, "%u", this->watchs[i].value);
-    WiServer.print(buffer);
-    if (i<this->watch_count-1) {
-      WiServer.println_P(JSON_NEXT_OBJECT);
-    } else {
-      WiServer.println('}');
+    REST_OUT.print(buffer);
+    REST_OUT.print_P(JSON_FREQUENCY);
+    sprintf(buffer, "%lu,", s->status.freq[i]);
+    REST_OUT.print(buffer);
+    if (this->watchs[i].freq_max) {
+      REST_OUT.print_P(JSON_RANGE);
+      sprintf(buffer, "[%lu,", this->watchs[i].freq_min);
+      REST_OUT.print(buffer);
+      sprintf(buffer, "%lu],", this->watchs[i].freq_max);
+      REST_OUT.print(buffer);
     }
+    REST_OUT.print_P(JSON_DESTINATIONS);
+    vwatch_handle_t h = watchHandle(&this->watchs[i]);
+    boolean first_dest = true;
+    for (struct cb_info *cb = cb_list; cb != NULL; cb = cb->next) {
+      if (cb->watch != h)
+        continue;
+      if (!first_dest)
+        REST_OUT.print(',');
+      first_dest = false;
+      REST_OUT.print_P(JSON_SERVER);
+      sprintf(buffer, "%u,", cb->srv_id);
+      REST_OUT.print(buffer);
+      REST_OUT.print_P(JSON_PATH);
+      REST_OUT.print(cb->path);
+      REST_OUT.print_P(JSON_END_OBJECT);
+    }
+    REST_OUT.print_P(JSON_NEXT_ARRAY);
+    REST_OUT.print_P(JSON_VALUE);
+    sprintf(buffer, "%u", s->status.value[i]);
+    REST_OUT.print(buffer);
   }
+  if (!first)
+    REST_OUT.println('}');
   
   // Send back the list of servers defined for the reception of
   // value changes.
-  WiServer.println_P(JSON_NEXT_ARRAY);
+  REST_OUT.println_P(JSON_NEXT_ARRAY);
   
-  WiServer.print_P(JSON_SERVERS);
-  WiServer.println('[');
+  REST_OUT.print_P(JSON_SERVERS);
+  REST_OUT.println('[');
+  first = true;
   for (int i=0; i<this->server_count;i++) {
-    WiServer.print('{');
-    WiServer.print_P(JSON_ID);
+    if (item++ < offset || item > end)
+      continue;
+    if (!first)
+      REST_OUT.println_P(JSON_NEXT_OBJECT);
+    first = false;
+    REST_OUT.print('{');
+    REST_OUT.print_P(JSON_ID);
     sprintf(buffer, "%u,", this->servers[i].id);
-    WiServer.print(buffer);
-    WiServer.print_P(JSON_IP);
-    WiServer.print(this->servers[i].hostName);
-    WiServer.print_P(JSON_NEXT_VALUE);
-    WiServer.print_P(JSON_PORT);
-    sprintf(buffer, "%u", this->servers[i].port);
-    WiServer.print(buffer);
-    if (i<this->server_count-1) {
-      WiServer.println_P(JSON_NEXT_OBJECT);
+    REST_OUT.print(buffer);
+    REST_OUT.print_P(JSON_IP);
+    REST_OUT.print(hostName(&this->servers[i], buffer));
+    REST_OUT.print_P(JSON_NEXT_VALUE);
+    REST_OUT.print_P(JSON_PORT);
+    sprintf(buffer, "%u,", this->servers[i].port);
+    REST_OUT.print(buffer);
+    REST_OUT.print_P(JSON_MODE);
+    sprintf(buffer, "%u,", this->servers[i].mode);
+    REST_OUT.print(buffer);
+    REST_OUT.print_P(JSON_FAILURES);
+    sprintf(buffer, "%u,", s->status.failures[i]);
+    REST_OUT.print(buffer);
+    REST_OUT.print_P(JSON_HEALTHY);
+    if (s->status.failures[i] < SERVER_UNHEALTHY) {
+      REST_OUT.print_P(JSON_TRUE_VALUE);
+    } else {
+      REST_OUT.print_P(JSON_FALSE_VALUE);
+    }
+  }
+  if (!first)
+    REST_OUT.println('}');
+#endif
+#ifdef HAVE_RULES
+  // Send back the rules, in the same form as the arguments of the
+  // rule_add command that would create them.
+  REST_OUT.println_P(JSON_NEXT_ARRAY);
+  
+  REST_OUT.print_P(JSON_RULES);
+  REST_OUT.println('[');
+  first = true;
+  for (int i=0; i<MAX_RULES; i++) {
+    rule_t *r = &this->rules[i];
+    if (r->type == VALUE_WATCH_NONE)
+      continue;
+    if (item++ < offset || item > end)
+      continue;
+    if (!first)
+      REST_OUT.println_P(JSON_NEXT_OBJECT);
+    first = false;
+    REST_OUT.print('{');
+    REST_OUT.print_P(JSON_ID);
+    sprintf(buffer, "%u,", i);
+    REST_OUT.print(buffer);
+    REST_OUT.print_P(JSON_RULE);
+    sprintf(buffer, "%u/%d/", r->type, r->position);
+    REST_OUT.print(buffer);
+    REST_OUT.print((char)pgm_read_byte(&rule_ops[r->op * 2]));
+    REST_OUT.print((char)pgm_read_byte(&rule_ops[r->op * 2 + 1]));
+    sprintf(buffer, "/%d/", r->threshold);
+    REST_OUT.print(buffer);
+    REST_OUT.print((r->action == RULE_ACTION_DPIN) ? 'd' : 's');
+    sprintf(buffer, "%u=%u", r->target, r->arg);
+    REST_OUT.print(buffer);
+    REST_OUT.print_P(JSON_NEXT_VALUE);
+    REST_OUT.print_P(JSON_ACTIVE);
+    if (s->status.active[i]) {
+      REST_OUT.print_P(JSON_TRUE_VALUE);
     } else {
-      WiServer.println('}');
+      REST_OUT.print_P(JSON_FALSE_VALUE);
     }
   }
+  if (!first)
+    REST_OUT.println('}');
 #endif
-  WiServer.println(']');  
+  if (item > end) {
+    REST_OUT.print_P(JSON_NEXT_ARRAY);
+    REST_OUT.print_P(JSON_NEXT);
+    sprintf(buffer, "%u", end);
+    REST_OUT.println(buffer);
+  } else {
+    REST_OUT.println(']');  
+  }
   
-  WiServer.println('}');
+  REST_OUT.println('}');
 }
 
 
+#ifdef HAVE_EEPROM
 void TinyREST::respond_read_eeprom(int start, int end) {
-  WiServer.print_P(JSON_RESPONSE);
+  respond_read_eeprom(start, end, EEPROM_PAGE);
+}
+
+// Respond the content of the EEPROM between start and end, but never
+// more than limit bytes at a time.  When the range is cut, "next"
+// gives the address to start the next page from.
+void TinyREST::respond_read_eeprom(int start, int end, int limit) {
+  int next = -1;
+  
+  if (end > E2END)
+    end = E2END;
+  if (limit > 0 && end - start >= limit) {
+    end = start + limit - 1;
+    next = end + 1;
+  }
+  
+  REST_OUT.print_P(JSON_RESPONSE);
   if (start == end) {
-    sprintf(buffer, "%u", EEPROM.read(start));
-    WiServer.print(buffer);
+    sprintf(buffer, "%u", readEEPROM(start));
+    REST_OUT.print(buffer);
   } else {
-    WiServer.print('[');
+    REST_OUT.print('[');
   
     for (int i = start; i<=end; i++) {
-      sprintf(buffer, "%u", EEPROM.read(i));
-      WiServer.print(buffer);
+      sprintf(buffer, "%u", readEEPROM(i));
+      REST_OUT.print(buffer);
       if ((i + 1) <= (end))
-        WiServer.print(',');
+        REST_OUT.print(',');
     }
   
     // Close brackets
-    WiServer.print(']');
+    REST_OUT.print(']');
+  }
+  if (next >= 0) {
+    REST_OUT.print(',');
+    REST_OUT.print_P(JSON_NEXT);
+    sprintf(buffer, "%u", next);
+    REST_OUT.print(buffer);
+  }
+  REST_OUT.print('}');
+}
+#endif
+
+#ifdef HAVE_SUBSCRIBE
+// Respond with the changes in the log that happened after the one with
+// the sequence number since, oldest first.  The response also carries
+// the sequence number of the last change, to be used for next call,
+// and whether changes have been lost, i.e. are no longer in the log.
+// The changes are copied to the snapshot on the call that brings the
+// request, so that all the segments of the response agree even when
+// the log moves on meanwhile.
+void TinyREST::respond_changes(unsigned int since) {
+  boolean fresh;
+  snapshot_t *s = takeSnapshot(&fresh);
+  
+  if (s == NULL) {
+    send_busy();
+    return;
+  }
+  if (fresh) {
+    unsigned int last = change_seq;
+    unsigned int first = since + 1;
+    
+    // Sequence numbers wrap, so all comparisons are on differences.  A
+    // client ahead of us comes from a previous life of the server.
+    s->wait.lost = (since != 0 && ((int)(last - since) > CHANGE_LOG_LEN
+                                   || (int)(since - last) > 0));
+    if (since == 0 || s->wait.lost) {
+      first = (last > CHANGE_LOG_LEN) ? last - CHANGE_LOG_LEN + 1 : 1;
+    }
+    s->wait.last = last;
+    s->wait.count = 0;
+    for (unsigned int seq = first; last != 0 && (int)(last - seq) >= 0; seq++) {
+      vchange_t *c = &changes[seq % CHANGE_LOG_LEN];
+      if (c->seq == seq)
+        s->wait.changes[s->wait.count++] = *c;
+    }
+  }
+  
+  REST_OUT.print_P(JSON_RESPONSE);
+  REST_OUT.print('[');
+  for (uint8_t i=0; i<s->wait.count; i++) {
+    vchange_t *c = &s->wait.changes[i];
+    REST_OUT.print('{');
+    REST_OUT.print_P(JSON_SEQ);
+    sprintf(buffer, "%u,", c->seq);
+    REST_OUT.print(buffer);
+    REST_OUT.print_P(JSON_TYPE);
+    sprintf(buffer, "%u,", c->type);
+    REST_OUT.print(buffer);
+    REST_OUT.print_P(JSON_POSITION);
+    sprintf(buffer, "%u,", c->position);
+    REST_OUT.print(buffer);
+    REST_OUT.print_P(JSON_VALUE);
+    sprintf(buffer, "%u", c->value);
+    REST_OUT.print(buffer);
+    if (i < s->wait.count - 1) {
+      REST_OUT.print_P(JSON_NEXT_OBJECT);
+    } else {
+      REST_OUT.print('}');
+    }
+  }
+  REST_OUT.print_P(JSON_NEXT_ARRAY);
+  REST_OUT.print_P(JSON_SEQ);
+  sprintf(buffer, "%u,", s->wait.last);
+  REST_OUT.print(buffer);
+  REST_OUT.print_P(JSON_LOST);
+  if (s->wait.lost) {
+    REST_OUT.print_P(JSON_TRUE);
+  } else {
+    REST_OUT.print_P(JSON_FALSE);
+  }
+}
+#endif
+
+#ifdef HAVE_STATS
+// Respond the statistics, as an object.  The counters move on with
+// every request and callback, so they are printed from the snapshot
+// taken on the first call, as for respond_status().
+void TinyREST::respond_stats() {
+  boolean fresh;
+  snapshot_t *s = takeSnapshot(&fresh);
+  
+  if (s == NULL) {
+    send_busy();
+    return;
   }
-  WiServer.print('}');
+  if (fresh)
+    s->stats = stats;
+  
+  REST_OUT.print_P(JSON_RESPONSE);
+  REST_OUT.print('{');
+  REST_OUT.print_P(JSON_REQUESTS);
+  sprintf(buffer, "%lu,", s->stats.requests);
+  REST_OUT.print(buffer);
+  REST_OUT.print_P(JSON_MAX);
+  sprintf(buffer, "%lu,", s->stats.request_max);
+  REST_OUT.print(buffer);
+  REST_OUT.print_P(JSON_TIMES);
+  REST_OUT.print('[');
+  for (uint8_t i=0; i<STATS_BUCKETS; i++) {
+    sprintf(buffer, (i < STATS_BUCKETS-1) ? "%u," : "%u",
+            s->stats.request_times[i]);
+    REST_OUT.print(buffer);
+  }
+  REST_OUT.print_P(JSON_NEXT_ARRAY);
+  REST_OUT.print_P(JSON_DELIVERED);
+  sprintf(buffer, "%lu,", s->stats.delivered);
+  REST_OUT.print(buffer);
+  REST_OUT.print_P(JSON_FAILED);
+  sprintf(buffer, "%lu,", s->stats.failed);
+  REST_OUT.print(buffer);
+  REST_OUT.print_P(JSON_DROPPED);
+  sprintf(buffer, "%lu,", s->stats.dropped);
+  REST_OUT.print(buffer);
+  REST_OUT.print_P(JSON_ALLOCS);
+  sprintf(buffer, "%lu,", s->stats.allocs);
+  REST_OUT.print(buffer);
+  REST_OUT.print_P(JSON_FREES);
+  sprintf(buffer, "%lu,", s->stats.frees);
+  REST_OUT.print(buffer);
+  REST_OUT.print_P(JSON_REJECTED);
+  sprintf(buffer, "%lu", s->stats.rejected);
+  REST_OUT.print(buffer);
+  REST_OUT.print('}');
+  REST_OUT.print('}');
 }
+#endif
 
 void TinyREST::send_true() {
-  WiServer.print_P(JSON_RESPONSE);
-  WiServer.print_P(JSON_TRUE);
+  REST_OUT.print_P(JSON_RESPONSE);
+  REST_OUT.print_P(JSON_TRUE);
 }
 
 void TinyREST::send_false() {
-  WiServer.print_P(JSON_RESPONSE);
-  WiServer.print_P(JSON_FALSE);
+  REST_OUT.print_P(JSON_RESPONSE);
+  REST_OUT.print_P(JSON_FALSE);
+}
+
+// Answer a request that cannot be performed for now, see admit() and
+// takeSnapshot().
+void TinyREST::send_busy() {
+  REST_OUT.print_P(JSON_RESPONSE);
+  REST_OUT.print_P(JSON_BUSY);
 }
 
 void TinyREST::send_int(int val) {
-  WiServer.print_P(JSON_RESPONSE);
+  REST_OUT.print_P(JSON_RESPONSE);
   sprintf(buffer, "%u", val);
-  WiServer.print(buffer);
-  WiServer.print('}');
+  REST_OUT.print(buffer);
+  REST_OUT.print('}');
 }
 
 void TinyREST::send_int_arr(unsigned int* arr, int len) {
-  WiServer.print_P(JSON_RESPONSE);
-  WiServer.print('[');
+  REST_OUT.print_P(JSON_RESPONSE);
+  REST_OUT.print('[');
   for (int i = 0; i<len; i++) {
     sprintf(buffer, "%u", *(arr+i));
-    WiServer.print(buffer);
+    REST_OUT.print(buffer);
     if ((i + 1) < (len))
-      WiServer.print(',');
+      REST_OUT.print(',');
   }
 
   // Close brackets
-  WiServer.print(']');
-  WiServer.print('}');
+  REST_OUT.print(']');
+  REST_OUT.print('}');
+}
+
+// Find the state of the request being handled, see request_state_t.
+// The state is set up when the request has just arrived, or when its
+// connection is not known (any more).
+request_state_t *TinyREST::findRequest() {
+  void *conn = REST_CONNECTION();
+  boolean fresh = REST_NEW_REQUEST();
+  request_state_t *r = NULL;
+  
+  for (uint8_t i=0; i<MAX_REQUESTS; i++) {
+    if (requests[i].conn == conn) {
+      r = &requests[i];
+      break;
+    }
+  }
+  if (r == NULL) {
+    r = &requests[request_next];
+    request_next = (request_next + 1) % MAX_REQUESTS;
+    r->conn = conn;
+    fresh = true;
+  }
+  if (fresh) {
+    r->calls = 0;
+#ifdef HAVE_ADMISSION
+    r->admission = ADMIT_PENDING;
+#endif
+  }
+  return r;
 }
 
+#ifdef HAVE_SNAPSHOT
+// Return the snapshot for the request being handled, see snapshot_t,
+// and set fresh when it has to be filled, i.e. on the call that brought
+// the request.  Returns NULL when another request holds it, and for the
+// rest of a request that did not get it on its first call, so that all
+// the segments of a busy answer stay busy.  Outside of handleURL() the
+// snapshot is filled on every call and not held.
+snapshot_t *TinyREST::takeSnapshot(boolean *fresh) {
+  unsigned long now = millis();
+  
+  if (snapshot_owner != NULL && snapshot_owner != request
+      && REST_CONNECTION_OPEN(snapshot_owner->conn)
+      && now - snapshot_used < SNAPSHOT_LEASE)
+    return NULL;
+  if (request != NULL && request->calls > 0 && snapshot_owner != request)
+    return NULL;
+  *fresh = (request == NULL || snapshot_owner != request
+            || request->calls == 0);
+  snapshot_owner = request;
+  snapshot_used = now;
+  return &snapshot;
+}
+#endif
+
 // This is the function that returns the content of the web
 // pages.  It analyses the URL (path) passed as an argument.
 // In that path, function names and arguments are separated by
@@ -213,6 +638,36 @@ void TinyREST::send_int_arr(unsigned int* arr, int len) {
 // including the list of commands that it supports, and the
 // list of subscriptions currently in registered.
 boolean TinyREST::handleURL(char* URL) {
+  boolean res;
+  
+  request = findRequest();
+#ifdef HAVE_STATS
+  unsigned long start = micros();
+  res = dispatchURL(URL);
+  unsigned long spent = micros() - start;
+  uint8_t bucket = 0;
+  
+  // Only the call that brought the request is counted, the next ones
+  // generate the next segments of the same response.
+  if (request->calls == 0) {
+    while (bucket < STATS_BUCKETS-1 && (spent >> (7 + bucket)) > 0)
+      bucket++;
+    stats.request_times[bucket]++;
+    stats.requests++;
+    if (spent > stats.request_max)
+      stats.request_max = spent;
+  }
+#else
+  res = dispatchURL(URL);
+#endif
+  if (request->calls < 0xFF)
+    request->calls++;
+  request = NULL;
+  return res;
+}
+
+// Parse the URL and perform the command, see handleURL().
+boolean TinyREST::dispatchURL(char* URL) {
   command_t *match;
 
   // Agnostically parsing the command by making sure req and
@@ -230,6 +685,12 @@ boolean TinyREST::handleURL(char* URL) {
       int res;
 #ifdef TINY_REST_DEBUG
       printCommand(match, "Command was recognised!", this->req_args);
+#endif
+#ifdef HAVE_ADMISSION
+      if (!admit(match->cost)) {
+        send_busy();
+        return false;
+      }
 #endif
       res = match->callback(this, match->cmd, this->req.len, this->req_args, match->blind);
       switch (res) {
@@ -250,6 +711,12 @@ boolean TinyREST::handleURL(char* URL) {
       }
     } else if (strcmp(this->req.cmd, "")==0) {
       // Unrecognised and empty command will return the status
+#ifdef HAVE_ADMISSION
+      if (!admit(ADMIT_COST_HEAVY)) {
+        send_busy();
+        return false;
+      }
+#endif
       respond_status();
       return true;
     }
@@ -265,16 +732,146 @@ boolean TinyREST::handleURL(char* URL) {
 // objects on the stack, which make the following code rather ugly.
 #define MAXRESPONDERS 3  // This must match the nb of __response vars below!!!
 static uint8_t nullIP[] = {0,0,0,0};
-GETrequest __response_1(nullIP, 0, "", "");
-GETrequest __response_2(nullIP, 0, "", "");
-GETrequest __response_3(nullIP, 0, "", "");
+REST_GET_REQUEST __response_1(nullIP, 0, "", "");
+REST_GET_REQUEST __response_2(nullIP, 0, "", "");
+REST_GET_REQUEST __response_3(nullIP, 0, "", "");
+
+// State of a responder with respect to the outcome of its request.
+#define RESPONDER_IDLE   (0)  // Nothing submitted, or outcome known
+#define RESPONDER_SENT   (1)  // Submitted, no answer yet
+#define RESPONDER_OK     (2)  // Server answered with a 2xx status
+#define RESPONDER_FAILED (3)  // Server answered with another status
+
 struct __responder {
-  GETrequest *r;    // Pointer to (stack) GETrequest
+  REST_GET_REQUEST *r;    // Pointer to (stack) GETrequest
   char *path;       // Complete URL path for the request (with value!) 
+  struct cb_info *cb;  // Subscription being delivered, NULL if none.
+  uint8_t srv_id;   // Server that the request was sent to.
+  uint8_t status;   // One of the RESPONDER_ constants above.
 };
 static struct __responder responses[MAXRESPONDERS];
 static boolean __responder_initialised = false;
 
+// Stream servers are all served by the same POST request, one at a time.
+// Its responder is never returned by findResponder().
+static void stream_body();
+REST_POST_REQUEST __stream_request(nullIP, 0, "", CALLBACK_STREAM_URL, stream_body);
+static struct __responder __stream;
+static TinyREST *__responder_owner = NULL;
+
+// Settle the outcome of the request of a responder once it has ended,
+// i.e. update the health of the server that it was sent to and arrange
+// for the subscription to be delivered again on failures.  The value
+// to deliver is kept in the subscription, so that a retry will carry
+// the latest value rather than the one that failed.
+static void responder_done(struct __responder *rsp) {
+  boolean ok = (rsp->status == RESPONDER_OK);
+  server_t *s = NULL;
+  
+  if (rsp->status == RESPONDER_IDLE)
+    return;
+  
+  if (__responder_owner != NULL)
+    s = __responder_owner->findServer(rsp->srv_id);
+#ifdef HAVE_STATS
+  if (ok) {
+    TinyREST::stats.delivered++;
+  } else {
+    TinyREST::stats.failed++;
+  }
+#endif
+  if (s != NULL) {
+    if (ok) {
+      s->failures = 0;
+      s->retryAt = 0;
+    } else {
+      uint8_t shift;
+      if (s->failures < 255) s->failures++;
+      shift = s->failures - 1;
+      if (shift > BACKOFF_MAX_SHIFT) shift = BACKOFF_MAX_SHIFT;
+      s->retryAt = millis() + ((unsigned long)BACKOFF_MIN << shift);
+#ifdef HAVE_FEDERATION
+      // We do not know what the peer got, push everything again.
+      if (s->mode == SERVER_MODE_PEER) {
+        for (uint8_t i=0; i<SYNC_DIRTY_LEN; i++)
+          s->dirty[i] = 0xFF;
+      }
+#endif
+    }
+  }
+  if (!ok && rsp->cb != NULL)
+    rsp->cb->pending = true;
+  
+  // The stream carries all the subscriptions that are flagged.
+  if (rsp == &__stream) {
+    for (struct cb_info *cb = cb_list; cb != NULL; cb = cb->next) {
+      if (cb->streaming) {
+        cb->streaming = false;
+        if (!ok) cb->pending = true;
+      }
+    }
+  }
+  
+  rsp->cb = NULL;
+  rsp->status = RESPONDER_IDLE;
+}
+
+// Called by WiServer with the data of the response to a request, and
+// with NULL once the connection has been closed, aborted or has timed
+// out.  Only the status line of the response is of interest to us.
+static void responder_result(struct __responder *rsp, char *data, int len) {
+  if (data != NULL && len > 0) {
+    if (rsp->status == RESPONDER_SENT) {
+      if (len > 9 && strncmp(data, "HTTP/1.", 7)==0 && data[9] == '2') {
+        rsp->status = RESPONDER_OK;
+      } else {
+        rsp->status = RESPONDER_FAILED;
+      }
+    }
+  } else {
+    responder_done(rsp);
+  }
+}
+
+// There is no way to pass a context to the return function of a
+// GETrequest, so we need one function per responder...
+static void __response_result_1(char *data, int len) {
+  responder_result(&responses[0], data, len);
+}
+static void __response_result_2(char *data, int len) {
+  responder_result(&responses[1], data, len);
+}
+static void __response_result_3(char *data, int len) {
+  responder_result(&responses[2], data, len);
+}
+static REST_RETURN_FUNC __response_results[MAXRESPONDERS] = {
+  __response_result_1, __response_result_2, __response_result_3
+};
+static void __stream_result(char *data, int len) {
+  responder_result(&__stream, data, len);
+}
+
+// Initialise the responder array, this is ugly, but was the only
+// solution that I could find, given that there are no way to 
+// dynamically create new objects...
+static void initResponders() {
+  if (!__responder_initialised) {
+    responses[0].r = &__response_1;
+    responses[1].r = &__response_2;
+    responses[2].r = &__response_3;
+    for (int i=0;i<MAXRESPONDERS;i++) {
+      responses[i].path = NULL;
+      responses[i].cb = NULL;
+      responses[i].status = RESPONDER_IDLE;
+    }
+    __stream.r = &__stream_request;
+    __stream.path = NULL;
+    __stream.cb = NULL;
+    __stream.status = RESPONDER_IDLE;
+    __responder_initialised = true;
+  }
+}
+
 // Find a responder that is available to perform a GET request and return
 // a pointer to it.  The function will take the opportunity to perform some
 // garbage collection by freeing all memory by the responses that have
@@ -290,8 +887,10 @@ static struct __responder *findResponder() {
     // would trash the memory before the GET resquest has been
     // executed.
     if (!rsp->r->isActive()) {
+      // Settle requests that ended without us being told.
+      responder_done(rsp);
       if (rsp->path!=NULL) {
-        free(rsp->path);
+        rest_free(rsp->path);
         rsp->path = NULL;
       }
     }
@@ -309,29 +908,74 @@ static struct __responder *findResponder() {
   return NULL;  // No responder could be found.
 }
 
-// This function is executed whenever a value callback should
-// be issued, i.e. whenever a value that we are watching has
-// changed and it is time to mediate this change to remote web
-// servers.  The function builds a GET request by adding the value
-// to the URL of the callback and attempts to perform that
-// request.
-static boolean value_callback(TinyREST *srv, int position, int value, int type, void *blind) {
-  struct cb_info *cb = (struct cb_info * )blind;
-  server_t *s = NULL;
+// Generate the body of the stream request, one line per subscription
+// being delivered: the path of the subscription followed by the value.
+// This is called by WiServer as many times as it needs (to count bytes
+// and on retransmissions), so it only prints the values that were
+// frozen when the request was submitted.
+static void stream_body() {
+  for (struct cb_info *cb = cb_list; cb != NULL; cb = cb->next) {
+    if (cb->streaming) {
+      char buffer[8];
+      REST_OUT.print(cb->path);
+      sprintf(buffer, "%u", cb->sent);
+      REST_OUT.println(buffer);
+    }
+  }
+}
+
+// Deliver all the pending values for a stream server in one single
+// POST request.  Values that change while the request is active stay
+// pending and will be part of the next request.
+static boolean deliver_stream(server_t *s) {
+  if (__stream.r->isActive())
+    return false;
+  responder_done(&__stream);
   
-  // Initialise the responder array, this is ugly, but was the only
-  // solution that I could find, given that there are no way to 
-  // dynamically create new objects...
-  if (!__responder_initialised) {
-    responses[0].r = &__response_1;
-    responses[0].path = NULL;
-    responses[1].r = &__response_2;
-    responses[1].path = NULL;
-    responses[2].r = &__response_3;
-    responses[2].path = NULL;
-    __responder_initialised = true;
+  // The path of the stream responder holds the host name.
+  if (__stream.path == NULL)
+    __stream.path = (char *)rest_malloc(16);
+  if (__stream.path == NULL)
+    return false;
+  
+  for (struct cb_info *cb = cb_list; cb != NULL; cb = cb->next) {
+    if (cb->pending && cb->srv_id == s->id) {
+      cb->sent = cb->value;
+      cb->streaming = true;
+      cb->pending = false;
+    }
   }
   
+  REST_SET_TARGET(__stream.r, s->ip, s->port);
+  __stream.r->hostName = TinyREST::hostName(s, __stream.path);
+  __stream.r->setReturnFunc(__stream_result);
+  __stream.srv_id = s->id;
+  __stream.status = RESPONDER_SENT;
+  __stream.r->submit();
+  return true;
+}
+
+static boolean deliver_get(server_t *s, struct cb_info *cb);
+
+// Hold off other requests to an unhealthy server until the outcome
+// of the one that was just sent (the probe) is known.
+static void hold_unhealthy(server_t *s, unsigned long now) {
+  if (s->failures >= SERVER_UNHEALTHY) {
+    uint8_t shift = s->failures - 1;
+    if (shift > BACKOFF_MAX_SHIFT) shift = BACKOFF_MAX_SHIFT;
+    s->retryAt = now + ((unsigned long)BACKOFF_MIN << shift);
+  }
+}
+
+// Attempt to deliver the pending value of a subscription to its server.
+// Nothing is sent while the server is backing off after failures, and
+// only one probe at a time is sent to servers that are unhealthy, so
+// that a dead server does not use all our responders.  The value stays
+// pending whenever it could not be sent, it will be retried from
+// TinyREST::loop().
+static boolean deliver(TinyREST *srv, struct cb_info *cb, unsigned long now) {
+  server_t *s = NULL;
+  
   // Look among our known servers for the one that matches the
   // identifier of the server associated to the callback.  
   s = srv->findServer(cb->srv_id);
@@ -339,45 +983,560 @@ static boolean value_callback(TinyREST *srv, int position, int value, int type,
 #ifdef TINY_REST_DEBUG
     Serial.println("Could not find server associated to callback!");
 #endif
+#ifdef HAVE_STATS
+    TinyREST::stats.dropped++;
+#endif
+    cb->pending = false;
+    return false;
+  }
+  
+  if (s->retryAt != 0 && (long)(now - s->retryAt) < 0)
+    return false;
+  
+  // A stream server that keeps failing gets its values one by one with
+  // GET requests, until one of them succeeds.
+  if (s->mode == SERVER_MODE_STREAM && s->failures < SERVER_UNHEALTHY) {
+    if (!deliver_stream(s))
+      return false;
   } else {
-    struct __responder *rsp = NULL;
-    
-    // Find an available responder context to perform the GET request
-    // associated to the callback.
-    rsp = findResponder();
-    if (rsp == NULL) {
+    if (!deliver_get(s, cb))
+      return false;
+  }
+  
+  hold_unhealthy(s, now);
+  return true;
+}
+
+// Deliver the pending value of a subscription with a GET request of
+// its own, the value being appended to the path of the subscription.
+static boolean deliver_get(server_t *s, struct cb_info *cb) {
+  struct __responder *rsp = NULL;
+  int len;
+  
+  // Find an available responder context to perform the GET request
+  // associated to the callback.
+  rsp = findResponder();
+  if (rsp == NULL) {
 #ifdef TINY_REST_DEBUG
-      Serial.println("Could not find any available responder!");
+    Serial.println("Could not find any available responder!");
 #endif
-    } else {
-      int len = strlen(cb->path);
-    
-      // Construct the returning path with current value, we append the
-      // value to the (static) path that was given at the time of the
-      // registration.
-      rsp->path = (char *)malloc(len+8);
-      strcpy(rsp->path, cb->path);
-      sprintf(&rsp->path[len], "%u", value);
-      
-      // Fill in the GETrequest object witht the necessary values. This is
-      // particularily ugly since it requires a knowledge of how these
-      // objects are actually constructed. But, but, I couldn't find any
-      // other nicer way since there are no functions to initiate these
-      // properly.
-      uip_ipaddr(&rsp->r->ipAddr, s->ip[0], s->ip[1], s->ip[2], s->ip[3]);
-      rsp->r->port = htons(s->port);
-      rsp->r->hostName = s->hostName;
-      rsp->r->URL = rsp->path;
-      rsp->r->setReturnFunc(NULL);
-      // Submit the get request on the queue.
-      rsp->r->submit();
-      return true;
+    return false;
+  }
+  
+  // Construct the returning path with current value, we append the
+  // value to the (static) path that was given at the time of the
+  // registration.
+  // The host name is printed right after the path, in the same block.
+  len = strlen(cb->path);
+  rsp->path = (char *)rest_malloc(len+8+16);
+  if (rsp->path == NULL)
+    return false;
+  strcpy(rsp->path, cb->path);
+  sprintf(&rsp->path[len], "%u", cb->value);
+  
+  // Fill in the GETrequest object witht the necessary values. This is
+  // particularily ugly since it requires a knowledge of how these
+  // objects are actually constructed. But, but, I couldn't find any
+  // other nicer way since there are no functions to initiate these
+  // properly.
+  REST_SET_TARGET(rsp->r, s->ip, s->port);
+  rsp->r->hostName = TinyREST::hostName(s, &rsp->path[len+8]);
+  rsp->r->URL = rsp->path;
+  rsp->r->setReturnFunc(__response_results[rsp - responses]);
+  rsp->cb = cb;
+  rsp->srv_id = s->id;
+  rsp->status = RESPONDER_SENT;
+  cb->pending = false;
+  
+  // Submit the get request on the queue.
+  rsp->r->submit();
+  return true;
+}
+
+// Retry delivery of all the subscriptions which values are pending,
+// i.e. which could not be sent or which delivery failed.
+static void retry_pending(TinyREST *srv, unsigned long now) {
+  if (!__responder_initialised)
+    return;
+  
+  for (struct cb_info *cb = cb_list; cb != NULL; cb = cb->next) {
+    if (cb->pending)
+      deliver(srv, cb, now);
+  }
+}
+
+#ifdef HAVE_FEDERATION
+// Push the dirty slots of the shared array to a peer, in batches of at
+// most SYNC_BATCH slots, as a GET request to the shared_sync command
+// of the peer.  Slots are clean once sent, the whole array is marked
+// dirty again if the request fails.
+static boolean deliver_sync(TinyREST *srv, server_t *s, unsigned long now) {
+  struct __responder *rsp = NULL;
+  uint8_t count = 0;
+  int len;
+  
+  if (s->retryAt != 0 && (long)(now - s->retryAt) < 0)
+    return false;
+  rsp = findResponder();
+  if (rsp == NULL)
+    return false;
+  
+  // Path is /shared_sync/<origin>/<slot>.<version>.<value>_..., followed
+  // by the host name.
+  rsp->path = (char *)rest_malloc(16 + SYNC_BATCH * 16 + 16);
+  if (rsp->path == NULL)
+    return false;
+  len = sprintf(rsp->path, "/shared_sync/%u/", srv->node_id);
+  for (uint8_t i=0; i<SHARED_LEN && count<SYNC_BATCH; i++) {
+    if (s->dirty[i / 8] & (1 << (i % 8))) {
+      s->dirty[i / 8] &= ~(1 << (i % 8));
+      len += sprintf(&rsp->path[len], (count == 0) ? "%u.%u.%u" : "_%u.%u.%u",
+                     i, srv->shared_version[i], srv->shared[i]);
+      count++;
+    }
+  }
+  len++;
+  
+  REST_SET_TARGET(rsp->r, s->ip, s->port);
+  rsp->r->hostName = TinyREST::hostName(s, &rsp->path[len]);
+  rsp->r->URL = rsp->path;
+  rsp->r->setReturnFunc(__response_results[rsp - responses]);
+  rsp->cb = NULL;
+  rsp->srv_id = s->id;
+  rsp->status = RESPONDER_SENT;
+  rsp->r->submit();
+  return true;
+}
+
+// Push the changes of the shared array to all the peers that have
+// some, one request per peer at most.
+static void sync_peers(TinyREST *srv, unsigned long now) {
+  for (server_t *s = srv->nextServer(NULL); s != NULL; s = srv->nextServer(s)) {
+    if (s->mode == SERVER_MODE_PEER) {
+      boolean dirty = false;
+      for (uint8_t i=0; i<SYNC_DIRTY_LEN; i++)
+        if (s->dirty[i]) dirty = true;
+      if (dirty) {
+        initResponders();
+        __responder_owner = srv;
+        if (deliver_sync(srv, s, now))
+          hold_unhealthy(s, now);
+      }
+    }
+  }
+}
+#endif
+
+// Forget about a subscription before its memory is freed: remove it
+// from the list of subscriptions and from the responders that might
+// still be delivering it.
+static void release_cb(struct cb_info *cb) {
+  struct cb_info **prev;
+  
+  for (prev = &cb_list; *prev != NULL; prev = &(*prev)->next) {
+    if (*prev == cb) {
+      *prev = cb->next;
+      break;
     }
   }
+  for (int i=0;i<MAXRESPONDERS;i++) {
+    if (responses[i].cb == cb)
+      responses[i].cb = NULL;
+  }
+}
+
+// This function is executed whenever a value callback should
+// be issued, i.e. whenever a value that we are watching has
+// changed and it is time to mediate this change to remote web
+// servers.  The function remembers the value in the subscription
+// and attempts to deliver it, if that fails the value will be
+// delivered later on from TinyREST::loop().  Changes that happen
+// before delivery are coalesced, only the last value is sent.
+static boolean value_callback(TinyREST *srv, int position, int value, int type, void *blind) {
+  vwatch_handle_t h = srv->watchHandle((vwatch_t *)blind);
+  unsigned long now = millis();
+  boolean sent = false;
+  
+  initResponders();
+  __responder_owner = srv;
+  
+  // Only subscriptions are logged for the wait command, so that a
+  // change seen by several watches on the same value is logged once.
+  srv->logChange((vwatch_t *)blind);
+  
+  // Feed the value to all the destinations of the watch.
+  for (struct cb_info *cb = cb_list; cb != NULL; cb = cb->next) {
+    if (cb->watch == h) {
+#ifdef HAVE_STATS
+      // The previous value was never sent, it is replaced.
+      if (cb->pending) TinyREST::stats.dropped++;
+#endif
+      cb->value = value;
+      cb->pending = true;
+      if (deliver(srv, cb, now)) sent = true;
+    }
+  }
+  return sent;
+}
+
+// Find the watch that serves subscriptions for a given value, i.e.
+// the one that calls value_callback, NULL if there is none.
+static vwatch_t *findSubscription(TinyREST *srv, uint8_t type, int position) {
+  vwatch_t *w;
+  
+  for (w = srv->findWatch(position, type); w != NULL; w = srv->nextWatch(w)) {
+    if (w->callback == value_callback)
+      return w;
+  }
+  return NULL;
+}
+
+// Find the watch that serves subscriptions for a given value, or
+// create it.  The frequency of the watch is updated unless freq is
+// negative, it is adapted up to freq_max when that one is greater, see
+// setFrequency().  The watch is its own blind argument, so that
+// value_callback can find its destinations.
+static vwatch_t *subscribe_watch(TinyREST *srv, uint8_t type, int position, long freq, unsigned long freq_max) {
+  vwatch_t *w = findSubscription(srv, type, position);
+  
+  if (w == NULL) {
+    w = srv->addWatch(position, type, 0, value_callback);
+    if (w == NULL)
+      return NULL;
+    w->blind = w;
+  }
+  if (freq >= 0)
+    srv->setFrequency(w, freq, freq_max);
+  return w;
+}
+
+// Find the destination of a watch that delivers to a given server.
+static struct cb_info *findDestination(vwatch_handle_t watch, uint8_t srv_id) {
+  for (struct cb_info *cb = cb_list; cb != NULL; cb = cb->next) {
+    if (cb->watch == watch && cb->srv_id == srv_id)
+      return cb;
+  }
+  return NULL;
+}
+
+// Arrange for the changes of a watch to be delivered to a server at a
+// given path.  There is one destination per server and watch, adding
+// the same server again changes the path.  Returns NULL when out of
+// memory.
+static struct cb_info *addDestination(vwatch_handle_t watch, uint8_t srv_id, char *path) {
+  struct cb_info *nfo = findDestination(watch, srv_id);
+  
+  if (nfo == NULL) {
+    nfo = (struct cb_info *)rest_malloc(sizeof(struct cb_info));
+    if (nfo == NULL)
+      return NULL;
+    nfo->watch = watch;
+    nfo->srv_id = srv_id;
+    nfo->pending = false;
+    nfo->streaming = false;
+    nfo->value = 0;
+    nfo->next = cb_list;
+    cb_list = nfo;
+  }
+  strlcpy(nfo->path, path, MAXPATH);
+  return nfo;
+}
+
+// Remove the destinations of a watch to a given server, or all the
+// destinations of the watch when srv_id is negative.  Returns the
+// number of destinations that remain for the watch.
+static uint8_t removeDestinations(vwatch_handle_t watch, int srv_id) {
+  uint8_t remain = 0;
+  struct cb_info *cb = cb_list;
   
+  while (cb != NULL) {
+    struct cb_info *next = cb->next;
+    if (cb->watch == watch) {
+      if (srv_id < 0 || cb->srv_id == srv_id) {
+        release_cb(cb);
+        rest_free(cb);
+      } else {
+        remain++;
+      }
+    }
+    cb = next;
+  }
+  return remain;
+}
+
+#ifdef HAVE_PERSIST
+// Persistent image of the servers and subscriptions, see TinyREST.h for
+// its layout.  Bytes are only written when they differ from what is in
+// the EEPROM already, which saves both time and EEPROM wear.
+//
+// A byte takes 3.3ms to write, so records are not written at once from
+// the request handler: a record is staged with persist_begin() and
+// persist_put(), and written one byte at a time from loop(), see
+// persist_flush().  Staging another record first finishes writing the
+// staged one.  The image is read through persist_read(), which sees
+// the bytes that are still staged.
+#define PERSIST_MAGIC_0  'T'
+#define PERSIST_MAGIC_1  'R'
+#define PERSIST_VALID    (0x5A)
+#define PERSIST_SEED     (0xA5)
+#define PERSIST_SERVER(i) (PERSIST_BASE + PERSIST_HEADER_LEN + (i) * PERSIST_SERVER_LEN)
+#define PERSIST_SUB(i)    (PERSIST_SERVER(PERSIST_SERVERS) + (i) * PERSIST_SUB_LEN)
+
+static uint8_t persist_stage[PERSIST_SUB_LEN];  // Record being written
+static int persist_stage_addr = -1;   // Address of the record, or -1
+static uint8_t persist_stage_len;     // Number of bytes staged
+static uint8_t persist_stage_done;    // Number of bytes written
+
+// Read a byte of the persistent image.
+static uint8_t persist_read(int addr) {
+  if (persist_stage_addr >= 0
+      && addr >= persist_stage_addr + persist_stage_done
+      && addr < persist_stage_addr + persist_stage_len)
+    return persist_stage[addr - persist_stage_addr];
+  return EEPROM.read(addr);
+}
+
+// Write the staged bytes that differ from the EEPROM: all of them,
+// waiting for the EEPROM, when wait is true, or else at most one and
+// only if the EEPROM is ready.  Returns true if bytes are left.
+static boolean persist_flush(boolean wait) {
+  while (persist_stage_addr >= 0) {
+    int addr = persist_stage_addr + persist_stage_done;
+    
+    if (persist_stage_done == persist_stage_len) {
+      persist_stage_addr = -1;
+      break;
+    }
+    if (EEPROM.read(addr) == persist_stage[persist_stage_done]) {
+      persist_stage_done++;
+      continue;
+    }
+    if (!eeprom_is_ready()) {
+      if (!wait)
+        return true;
+      continue;
+    }
+    EEPROM.write(addr, persist_stage[persist_stage_done++]);
+    if (!wait)
+      return persist_stage_done < persist_stage_len;
+  }
   return false;
 }
 
+// Start staging a record at a given address.
+static void persist_begin(int addr) {
+  persist_flush(true);
+  persist_stage_addr = addr;
+  persist_stage_len = 0;
+  persist_stage_done = 0;
+}
+
+// Stage a byte of the record, and account for it in the checksum of
+// the record.  Returns the next address.
+static int persist_put(int addr, uint8_t b, uint8_t *sum) {
+  uint8_t i = addr - persist_stage_addr;
+  
+  persist_stage[i] = b;
+  if (i >= persist_stage_len)
+    persist_stage_len = i + 1;
+  *sum += b;
+  return addr + 1;
+}
+
+// Check that a record is in use and that its checksum is right.
+static boolean persist_valid(int addr, uint8_t len) {
+  uint8_t sum = PERSIST_SEED;
+  
+  if (persist_read(addr) != PERSIST_VALID)
+    return false;
+  for (uint8_t i=0; i<len-1; i++)
+    sum += persist_read(addr + i);
+  return persist_read(addr + len - 1) == sum;
+}
+
+// Mark a record as unused, this is a single byte write.
+static void persist_clear(int addr) {
+  uint8_t sum = 0;
+  
+  persist_begin(addr);
+  persist_put(addr, 0, &sum);
+}
+
+// Find the record of a server, or a free record when it has none.
+// Returns -1 when there is no room.
+static int persist_find_server(uint8_t id) {
+  int room = -1;
+  
+  for (uint8_t i=0; i<PERSIST_SERVERS; i++) {
+    int addr = PERSIST_SERVER(i);
+    if (persist_valid(addr, PERSIST_SERVER_LEN)) {
+      if (persist_read(addr + 1) == id)
+        return addr;
+    } else if (room < 0) {
+      room = addr;
+    }
+  }
+  return room;
+}
+
+// Find the record of a subscription of a value for a server, or a free
+// record when it has none.  Returns -1 when there is no room.
+static int persist_find_sub(uint8_t type, int position, uint8_t srv_id) {
+  int room = -1;
+  
+  for (uint8_t i=0; i<PERSIST_SUBS; i++) {
+    int addr = PERSIST_SUB(i);
+    if (persist_valid(addr, PERSIST_SUB_LEN)) {
+      if (persist_read(addr + 1) == type
+          && persist_read(addr + 2) == (position & 0xFF)
+          && persist_read(addr + 3) == ((position >> 8) & 0xFF)
+          && persist_read(addr + 8) == srv_id)
+        return addr;
+    } else if (room < 0) {
+      room = addr;
+    }
+  }
+  return room;
+}
+
+// Remember a server in the persistent image.
+static void persist_server(server_t *s) {
+  int addr = persist_find_server(s->id);
+  uint8_t sum = PERSIST_SEED;
+  
+  if (addr < 0)
+    return;
+  persist_begin(addr);
+  addr = persist_put(addr, PERSIST_VALID, &sum);
+  addr = persist_put(addr, s->id, &sum);
+  for (uint8_t i=0; i<4; i++)
+    addr = persist_put(addr, s->ip[i], &sum);
+  addr = persist_put(addr, s->port & 0xFF, &sum);
+  addr = persist_put(addr, (s->port >> 8) & 0xFF, &sum);
+  addr = persist_put(addr, s->mode, &sum);
+  persist_put(addr, sum, &sum);
+}
+
+// Forget about a server in the persistent image.
+static void persist_server_removed(uint8_t id) {
+  int addr = persist_find_server(id);
+  
+  if (addr >= 0 && persist_valid(addr, PERSIST_SERVER_LEN))
+    persist_clear(addr);
+}
+
+// Remember all the destinations of a subscription watch.  Returns false
+// if some of them could not be remembered, all the records being used.
+static boolean persist_watch(vwatch_t *w, vwatch_handle_t h) {
+  boolean saved = true;
+  
+  for (struct cb_info *cb = cb_list; cb != NULL; cb = cb->next) {
+    if (cb->watch != h)
+      continue;
+    
+    int addr = persist_find_sub(w->type, w->position, cb->srv_id);
+    uint8_t sum = PERSIST_SEED;
+    if (addr < 0) {
+      saved = false;
+      continue;
+    }
+    persist_begin(addr);
+    addr = persist_put(addr, PERSIST_VALID, &sum);
+    addr = persist_put(addr, w->type, &sum);
+    addr = persist_put(addr, w->position & 0xFF, &sum);
+    addr = persist_put(addr, (w->position >> 8) & 0xFF, &sum);
+    for (uint8_t i=0; i<4; i++)
+      addr = persist_put(addr, (w->freq_min >> (8 * i)) & 0xFF, &sum);
+    addr = persist_put(addr, cb->srv_id, &sum);
+    for (uint8_t i=0; i<4; i++)
+      addr = persist_put(addr, (w->freq_max >> (8 * i)) & 0xFF, &sum);
+    for (uint8_t i=0; i<MAXPATH; i++)
+      addr = persist_put(addr, cb->path[i], &sum);
+    persist_put(addr, sum, &sum);
+  }
+  return saved;
+}
+
+// Forget about the subscriptions of a value in the persistent image,
+// for one server or for all servers when srv_id is negative.
+static void persist_unsubscribed(uint8_t type, int position, int srv_id) {
+  for (uint8_t i=0; i<PERSIST_SUBS; i++) {
+    int addr = PERSIST_SUB(i);
+    if (persist_valid(addr, PERSIST_SUB_LEN)
+        && persist_read(addr + 1) == type
+        && persist_read(addr + 2) == (position & 0xFF)
+        && persist_read(addr + 3) == ((position >> 8) & 0xFF)
+        && (srv_id < 0 || persist_read(addr + 8) == srv_id))
+      persist_clear(addr);
+  }
+}
+
+// Restore the servers and subscriptions from the persistent image.  An
+// image from another version or configuration of the library is wiped
+// out, records with a wrong checksum are dropped.
+static void persist_load(TinyREST *srv) {
+  if (persist_read(PERSIST_BASE) != PERSIST_MAGIC_0
+      || persist_read(PERSIST_BASE + 1) != PERSIST_MAGIC_1
+      || persist_read(PERSIST_BASE + 2) != PERSIST_VERSION
+      || persist_read(PERSIST_BASE + 3) != PERSIST_SERVERS
+      || persist_read(PERSIST_BASE + 4) != PERSIST_SUBS
+      || persist_read(PERSIST_BASE + 5) != MAXPATH) {
+    uint8_t sum = 0;
+    for (uint8_t i=0; i<PERSIST_SERVERS; i++)
+      persist_clear(PERSIST_SERVER(i));
+    for (uint8_t i=0; i<PERSIST_SUBS; i++)
+      persist_clear(PERSIST_SUB(i));
+    persist_begin(PERSIST_BASE);
+    persist_put(PERSIST_BASE, PERSIST_MAGIC_0, &sum);
+    persist_put(PERSIST_BASE + 1, PERSIST_MAGIC_1, &sum);
+    persist_put(PERSIST_BASE + 2, PERSIST_VERSION, &sum);
+    persist_put(PERSIST_BASE + 3, PERSIST_SERVERS, &sum);
+    persist_put(PERSIST_BASE + 4, PERSIST_SUBS, &sum);
+    persist_put(PERSIST_BASE + 5, MAXPATH, &sum);
+    persist_flush(true);
+    return;
+  }
+  
+  for (uint8_t i=0; i<PERSIST_SERVERS; i++) {
+    int addr = PERSIST_SERVER(i);
+    if (!persist_valid(addr, PERSIST_SERVER_LEN)) {
+      persist_clear(addr);
+      continue;
+    }
+    sprintf(srv->buffer, "%u.%u.%u.%u", persist_read(addr + 2),
+            persist_read(addr + 3), persist_read(addr + 4), persist_read(addr + 5));
+    srv->addServer(persist_read(addr + 1), srv->buffer,
+                   persist_read(addr + 6) | (persist_read(addr + 7) << 8),
+                   persist_read(addr + 8));
+  }
+  
+  for (uint8_t i=0; i<PERSIST_SUBS; i++) {
+    int addr = PERSIST_SUB(i);
+    char path[MAXPATH];
+    unsigned long freq = 0;
+    unsigned long freq_max = 0;
+    vwatch_t *w;
+    
+    if (!persist_valid(addr, PERSIST_SUB_LEN)) {
+      persist_clear(addr);
+      continue;
+    }
+    for (uint8_t j=0; j<4; j++) {
+      freq |= (unsigned long)persist_read(addr + 4 + j) << (8 * j);
+      freq_max |= (unsigned long)persist_read(addr + 9 + j) << (8 * j);
+    }
+    for (uint8_t j=0; j<MAXPATH; j++)
+      path[j] = persist_read(addr + 13 + j);
+    path[MAXPATH-1] = '\0';
+    w = subscribe_watch(srv, persist_read(addr + 1),
+                        persist_read(addr + 2) | (persist_read(addr + 3) << 8),
+                        freq, freq_max);
+    if (w != NULL)
+      addDestination(srv->watchHandle(w), persist_read(addr + 8), path);
+  }
+}
+#endif
+
 // Convert an encoded URL to its unencoded form.  The function only
 // recognises the %xx form for the escapes.  It unescape DIRECTLY in the
 // string for saving memory.
@@ -412,37 +1571,116 @@ static char *unescape_url(char *url) {
 }
 #endif
 
-// Below are the SDRAM strings for the commands that the server
-// supports by default.
+// Below are the PROGMEM strings for the commands that the server
+// supports by default.  The dispatcher is given back the pointer
+// that was registered, so commands are recognised by their address.
+const char cmd_status[] PROGMEM = {"status"};
+#ifdef HAVE_STATS
+const char cmd_stats[] PROGMEM = {"stats"};
+#endif
+#ifdef HAVE_MEM
+const char cmd_mem[] PROGMEM = {"mem"};
+#endif
 #ifdef HAVE_SHARED
-static char cmd_read_shared[] = {"shared_read"};
-static char cmd_write_shared[] = {"shared_write"};
-#endif
-static char cmd_read_eeprom[] = {"eeprom_read"};
-static char cmd_write_eeprom[] = {"eeprom_write"};
-static char cmd_read_dpin[] = {"dpin_read"};
-static char cmd_write_dpin[] = {"dpin_write"};
-static char cmd_dpin_mode[] = {"dpin_mode"};
-static char cmd_read_apin[] = {"apin_read"};
+const char cmd_read_shared[] PROGMEM = {"shared_read"};
+const char cmd_write_shared[] PROGMEM = {"shared_write"};
+#endif
+#ifdef HAVE_FEDERATION
+const char cmd_sync_shared[] PROGMEM = {"shared_sync"};
+#endif
+#ifdef HAVE_EEPROM
+const char cmd_read_eeprom[] PROGMEM = {"eeprom_read"};
+const char cmd_write_eeprom[] PROGMEM = {"eeprom_write"};
+#endif
+#ifdef HAVE_PINS
+const char cmd_read_dpin[] PROGMEM = {"dpin_read"};
+const char cmd_write_dpin[] PROGMEM = {"dpin_write"};
+const char cmd_dpin_mode[] PROGMEM = {"dpin_mode"};
+const char cmd_read_apin[] PROGMEM = {"apin_read"};
+const char cmd_write_apin[] PROGMEM = {"apin_write"};
+const char cmd_write_dpin_mask[] PROGMEM = {"dpin_write_mask"};
+const char cmd_dpin_mode_mask[] PROGMEM = {"dpin_mode_mask"};
+#endif
 #ifdef HAVE_SUBSCRIBE
-static char cmd_subscribe[] = {"subscribe"};
-static char cmd_unsubscribe[] = {"unsubscribe"};
-static char cmd_add_server[] = {"server_add"};
-static char cmd_remove_server[] = {"server_remove"};
+const char cmd_subscribe[] PROGMEM = {"subscribe"};
+const char cmd_unsubscribe[] PROGMEM = {"unsubscribe"};
+const char cmd_add_server[] PROGMEM = {"server_add"};
+const char cmd_remove_server[] PROGMEM = {"server_remove"};
+const char cmd_wait[] PROGMEM = {"wait"};
+#endif
+#ifdef HAVE_RULES
+const char cmd_add_rule[] PROGMEM = {"rule_add"};
+const char cmd_remove_rule[] PROGMEM = {"rule_remove"};
+#endif
+
+#ifdef HAVE_PINS
+// Return the output register (or the data direction register when mode
+// is true) of an I/O port given by its letter, or NULL if no pin of the
+// board is on that port.  The bits of the pins of the port that the
+// transport uses are set in reserved.  Ports are numbered from 1 for A,
+// as in the pin tables of the Arduino core.
+static volatile uint8_t *port_register(char *port, boolean mode,
+                                       uint8_t *reserved) {
+  uint8_t p = (port[0] & ~0x20) - 'A' + 1;   // Upper case
+  boolean found = false;
+  
+  if (port[1] != '\0')
+    return NULL;
+  *reserved = 0;
+  for (uint8_t pin=0; pin<NUM_DIGITAL_PINS; pin++) {
+    if (digitalPinToPort(pin) == p) {
+      found = true;
+      if (REST_RESERVED_PIN(pin))
+        *reserved |= digitalPinToBitMask(pin);
+    }
+  }
+  if (!found)
+    return NULL;
+  return mode ? portModeRegister(p) : portOutputRegister(p);
+}
+
+// Set the bits of mask in a port register to those of value, with the
+// interrupts off so that all pins change at once and no interrupt
+// handler writes the register in between.
+static void write_port(volatile uint8_t *reg, uint8_t mask, uint8_t value) {
+  uint8_t oldSREG = SREG;
+  
+  cli();
+  *reg = (*reg & ~mask) | (value & mask);
+  SREG = oldSREG;
+}
 #endif
 
 // This function implements the "big-switch", i.e. it dispatch
 // the incoming command to its relevant function in the code of
 // the server.
 static int cmd_dispatcher(TinyREST *srv, char *cmd, int len, char **args, void *blind) {
-  if (strcmp(cmd, cmd_read_dpin)==0) {
+  if (cmd == NULL) {
+    return RESPONSE_ERROR;
+  } else if (cmd == cmd_status) {
+    // status <offset> <limit>
+    srv->respond_status(atoi(args[0]), atoi(args[1]));
+    return RESPONSE_INLINE_OK;
+#ifdef HAVE_STATS
+  } else if (cmd == cmd_stats) {
+    srv->respond_stats();
+    return RESPONSE_INLINE_OK;
+#endif
+#ifdef HAVE_MEM
+  } else if (cmd == cmd_mem) {
+    srv->respond_mem();
+    return RESPONSE_INLINE_OK;
+#endif
+#ifdef HAVE_PINS
+  } else if (cmd == cmd_read_dpin) {
     srv->send_int(digitalRead(atoi(args[0])));
     return RESPONSE_INLINE_OK;
-  } else if (strcmp(cmd, cmd_read_apin)==0) {
+  } else if (cmd == cmd_read_apin) {
     srv->send_int(analogRead(atoi(args[0])));
     return RESPONSE_INLINE_OK;
+#endif
 #ifdef HAVE_SHARED
-  } else if (strcmp(cmd, cmd_read_shared)==0) {
+  } else if (cmd == cmd_read_shared) {
     if (len == 0) {
       srv->send_int_arr(srv->shared, SHARED_LEN);
       return RESPONSE_INLINE_OK;
@@ -453,41 +1691,100 @@ static int cmd_dispatcher(TinyREST *srv, char *cmd, int len, char **args, void *
       return RESPONSE_ERROR;
     }
 #endif
-  } else if (strcmp(cmd, cmd_read_eeprom)==0) {
+#ifdef HAVE_EEPROM
+  } else if (cmd == cmd_read_eeprom) {
     if (len == 1) {
       srv->respond_read_eeprom(atoi(args[0]), atoi(args[0]));
       return RESPONSE_INLINE_OK;
     } else if (len == 2) {
       srv->respond_read_eeprom(atoi(args[0]), atoi(args[1]));
       return RESPONSE_INLINE_OK;
+    } else if (len == 3) {
+      srv->respond_read_eeprom(atoi(args[0]), atoi(args[1]), atoi(args[2]));
+      return RESPONSE_INLINE_OK;
     } else {
       return RESPONSE_ERROR;
     }
+  } else if (cmd == cmd_write_eeprom) {
+    if (atoi(args[0]) < 0 || atoi(args[0]) > E2END)
+      return RESPONSE_ERROR;
+#ifdef HAVE_PERSIST
+    // Protect the persistent image of servers and subscriptions.
+    if (atoi(args[0]) >= PERSIST_BASE)
+      return RESPONSE_ERROR;
+#endif
+    srv->writeEEPROM(atoi(args[0]), atoi(args[1]));
+#endif
 #ifdef HAVE_SHARED
-  } else if (strcmp(cmd, cmd_write_shared)==0) {
+  } else if (cmd == cmd_write_shared) {
     if (atoi(args[0]) < SHARED_LEN) {
-      srv->shared[atoi(args[0])] = atoi(args[1]);
+      srv->writeShared(atoi(args[0]), atoi(args[1]));
     } else {
       return RESPONSE_ERROR;
     }
 #endif
-  } else if (strcmp(cmd, cmd_write_dpin)==0) {
+#ifdef HAVE_FEDERATION
+  } else if (cmd == cmd_sync_shared) {
+    // shared_sync <origin> <slot>.<version>.<value>_...
+    // Numbers are range-checked before they are narrowed, so that an
+    // out of range slot cannot wrap around onto another one.
+    unsigned long origin = strtoul(args[0], NULL, 10);
+    char *p = args[1];
+    if (origin > 255) return RESPONSE_ERROR;
+    while (*p) {
+      unsigned long slot = strtoul(p, &p, 10);
+      unsigned long version;
+      unsigned long value;
+      if (*p++ != '.') return RESPONSE_ERROR;
+      version = strtoul(p, &p, 10);
+      if (*p++ != '.') return RESPONSE_ERROR;
+      value = strtoul(p, &p, 10);
+      if (slot >= SHARED_LEN || version > 255 || value > 0xFFFF)
+        return RESPONSE_ERROR;
+      srv->syncShared(slot, version, value, origin);
+      if (*p == '_') p++;
+      else if (*p) return RESPONSE_ERROR;
+    }
+#endif
+#ifdef HAVE_PINS
+  } else if (cmd == cmd_write_dpin) {
+    if (REST_RESERVED_PIN(atoi(args[0])))
+      return RESPONSE_ERROR;
     if (atoi(args[1])) { 
       digitalWrite(atoi(args[0]), HIGH);
     } else {
       digitalWrite(atoi(args[0]), LOW);
     }
-  } else if (strcmp(cmd, cmd_write_eeprom)==0) {
-    EEPROM.write(atoi(args[0]), atoi(args[1]));
-    return RESPONSE_INLINE_OK;
-  } else if (strcmp(cmd, cmd_dpin_mode)==0) {
+  } else if (cmd == cmd_dpin_mode) {
+    if (REST_RESERVED_PIN(atoi(args[0])))
+      return RESPONSE_ERROR;
     if (atoi(args[1])) {
       pinMode(atoi(args[0]), INPUT);
     } else {
       pinMode(atoi(args[0]), OUTPUT);
     }
+  } else if (cmd == cmd_write_dpin_mask) {
+    // dpin_write_mask <port> <mask> <value>
+    uint8_t reserved;
+    volatile uint8_t *reg = port_register(args[0], false, &reserved);
+    if (reg == NULL || (atoi(args[1]) & reserved))
+      return RESPONSE_ERROR;
+    write_port(reg, atoi(args[1]) & ~reserved, atoi(args[2]));
+  } else if (cmd == cmd_dpin_mode_mask) {
+    // dpin_mode_mask <port> <mask> <modes>, the data direction
+    // register has 1 for outputs.
+    uint8_t reserved;
+    volatile uint8_t *reg = port_register(args[0], true, &reserved);
+    if (reg == NULL || (atoi(args[1]) & reserved))
+      return RESPONSE_ERROR;
+    write_port(reg, atoi(args[1]) & ~reserved, ~atoi(args[2]));
+  } else if (cmd == cmd_write_apin) {
+    if (REST_RESERVED_PIN(atoi(args[0])))
+      return RESPONSE_ERROR;
+    analogWrite(atoi(args[0]), atoi(args[1]));
+#endif
 #ifdef HAVE_SUBSCRIBE
-  } else if (strcmp(cmd, cmd_subscribe)==0) {
+  } else if (cmd == cmd_subscribe) {
     int type = atoi(args[0]);
 
     // Discard not-allowed types, this really is an if-statement written
@@ -503,39 +1800,124 @@ static int cmd_dispatcher(TinyREST *srv, char *cmd, int len, char **args, void *
       default:
         return RESPONSE_ERROR;
     }  	
-    if (len == 4) {
-		// subscribe <type> <position> <server> <path>
-      struct cb_info *nfo = (struct cb_info *)malloc(sizeof(struct cb_info));
-      strlcpy(nfo->path, unescape_url(args[3]), MAXPATH);
-      nfo->srv_id = atoi(args[2]);
-      vwatch_t *w = srv->addWatch(atoi(args[1]), type, value_callback, nfo);
-	  if (w==NULL)
-		return RESPONSE_ERROR;
-    } else if (len == 5) {
-		// subscribe <type> <position> <server> <freq> <path>
-      struct cb_info *nfo = (struct cb_info *)malloc(sizeof(struct cb_info));
-      strlcpy(nfo->path, unescape_url(args[4]), MAXPATH);
-      nfo->srv_id = atoi(args[2]);
-      vwatch_t *w = srv->addWatch(atoi(args[1]), type, atoi(args[3]), value_callback, nfo);
-	  if (w==NULL)
-		return RESPONSE_ERROR;
+    // All subscriptions to a value share the same watch, the servers
+    // being destinations of that watch.
+    vwatch_t *w = NULL;
+    boolean created = (findSubscription(srv, type, atoi(args[1])) == NULL);
+    if (len == 2) {
+      // subscribe <type> <position>
+      w = subscribe_watch(srv, type, atoi(args[1]), -1, 0);
+    } else if (len == 3 || len == 5) {
+      // subscribe <type> <position> <freq>
+      // subscribe <type> <position> <server> <freq> <path>
+      // where <freq> is <min>:<max> for adaptive sampling.
+      char *p;
+      long freq = strtol((len == 3) ? args[2] : args[3], &p, 10);
+      unsigned long freq_max = (*p == ':') ? strtoul(p + 1, NULL, 10) : 0;
+      w = subscribe_watch(srv, type, atoi(args[1]), freq, freq_max);
     } else {
+      // subscribe <type> <position> <server> <path>
+      w = subscribe_watch(srv, type, atoi(args[1]), -1, 0);
+    }
+    if (w==NULL)
       return RESPONSE_ERROR;
+    if (len >= 4) {
+      if (addDestination(srv->watchHandle(w), atoi(args[2]),
+                         unescape_url(args[len - 1])) == NULL) {
+        // Do not leave a watch without destinations behind us.
+        if (created)
+          srv->removeWatch(w);
+        return RESPONSE_ERROR;
+      }
+    }
+#ifdef HAVE_PERSIST
+    // The subscription works, but will not survive a reset.
+    if (!persist_watch(w, srv->watchHandle(w))) {
+      REST_OUT.print_P(JSON_RESPONSE);
+      REST_OUT.print_P(JSON_UNSAVED);
+      return RESPONSE_INLINE_OK;
     }
-  } else if (strcmp(cmd, cmd_unsubscribe)==0) {
-	// unsubscribe <type> <position>
-	vwatch_t *w = srv->findWatch(atoi(args[1]), atoi(args[0]));
-    if (w) {
-      free(w->blind);
+#endif
+  } else if (cmd == cmd_unsubscribe) {
+    // unsubscribe <type> <position>
+    // unsubscribe <type> <position> <server>
+    vwatch_t *w = findSubscription(srv, atoi(args[0]), atoi(args[1]));
+    if (w == NULL)
+      return RESPONSE_ERROR;
+#ifdef HAVE_PERSIST
+    persist_unsubscribed(w->type, w->position, (len == 2) ? -1 : atoi(args[2]));
+#endif
+    if (len == 2) {
+      removeDestinations(srv->watchHandle(w), -1);
       srv->removeWatch(w);
     } else {
-      return RESPONSE_ERROR;
+      vwatch_handle_t h = srv->watchHandle(w);
+      if (findDestination(h, atoi(args[2])) == NULL)
+        return RESPONSE_ERROR;
+      // The watch goes with its last destination.
+      if (removeDestinations(h, atoi(args[2])) == 0)
+        srv->removeWatch(w);
+    }
+  } else if (cmd == cmd_wait) {
+    // wait [<seq>]
+    unsigned int since = (len == 1) ? (unsigned int)atol(args[0]) : 0;
+    srv->respond_changes(since);
+    return RESPONSE_INLINE_OK;
+  } else if (cmd == cmd_add_server) {
+    // server_add <id> <ip> <port> [<mode>]
+    server_t *s = NULL;
+    if (len == 3) {
+      s = srv->addServer(atoi(args[0]), args[1], atoi(args[2]));
+    } else {
+      s = srv->addServer(atoi(args[0]), args[1], atoi(args[2]), atoi(args[3]));
     }
-  } else if (strcmp(cmd, cmd_add_server)==0) {
-    server_t *s = srv->addServer(atoi(args[0]), args[1], atoi(args[2]));
 	if (s==NULL) return RESPONSE_ERROR;
-  } else if (strcmp(cmd, cmd_remove_server)==0) {
+#ifdef HAVE_PERSIST
+    persist_server(s);
+#endif
+  } else if (cmd == cmd_remove_server) {
     srv->removeServer(atoi(args[0]));
+#ifdef HAVE_PERSIST
+    persist_server_removed(atoi(args[0]));
+#endif
+#endif
+#ifdef HAVE_RULES
+  } else if (cmd == cmd_add_rule) {
+    // rule_add <type> <position> <op> <threshold> <action>
+    uint8_t op;
+    uint8_t action;
+    char *p = args[4];
+    int id;
+    for (op = 0; op <= RULE_NE; op++) {
+      if (args[2][0] == pgm_read_byte(&rule_ops[op * 2])
+          && args[2][1] == pgm_read_byte(&rule_ops[op * 2 + 1])
+          && args[2][2] == '\0')
+        break;
+    }
+    if (op > RULE_NE)
+      return RESPONSE_ERROR;
+    // The action is d<pin>=<value> or s<slot>=<value>
+    if (*p == 'd') {
+      action = RULE_ACTION_DPIN;
+    } else if (*p == 's') {
+      action = RULE_ACTION_SHARED;
+    } else {
+      return RESPONSE_ERROR;
+    }
+    // The target is range-checked before it is narrowed, so that it
+    // cannot wrap around onto another pin or slot.
+    unsigned long target = strtoul(p + 1, &p, 10);
+    if (*p++ != '=' || target > 255)
+      return RESPONSE_ERROR;
+    id = srv->addRule(atoi(args[0]), atoi(args[1]), op, atoi(args[3]),
+                      action, target, strtoul(p, NULL, 10));
+    if (id < 0)
+      return RESPONSE_ERROR;
+    srv->send_int(id);
+    return RESPONSE_INLINE_OK;
+  } else if (cmd == cmd_remove_rule) {
+    if (!srv->removeRule(atoi(args[0])))
+      return RESPONSE_ERROR;
 #endif
   } else {
     return RESPONSE_ERROR;
@@ -549,7 +1931,13 @@ void TinyREST::printCommand(command_t *r, char *header, char *args[])
 {
   if (header) Serial.println(header);
   Serial.print("CMD: ");
-  Serial.println(r->cmd);
+  if (r->flags & CMD_PROGMEM) {
+    for (const char *c = r->cmd; pgm_read_byte(c); c++)
+      Serial.print((char)pgm_read_byte(c));
+    Serial.println("");
+  } else {
+    Serial.println(r->cmd);
+  }
   sprintf(buffer, "%u", r->len);
   Serial.print(buffer);
   if (args == NULL) {
@@ -577,6 +1965,10 @@ command_t *TinyREST::addCommand(char *cmd, uint8_t len, CommandCallback cb, void
     cmds[cmd_count].cmd = cmd;  // Note we COPY the pointer for
                                 // saving memory!
     cmds[cmd_count].len = len;
+    cmds[cmd_count].flags = 0;
+#ifdef HAVE_ADMISSION
+    cmds[cmd_count].cost = 1;
+#endif
     cmds[cmd_count].callback = cb;
     cmds[cmd_count].blind = blind;
 #ifdef TINY_REST_DEBUG
@@ -597,6 +1989,22 @@ command_t *TinyREST::addCommand(char *cmd, uint8_t len, CommandCallback cb) {
 }
 
 
+// Same as above, but the name of the command is a PROGMEM string,
+// which saves on precious RAM.
+command_t *TinyREST::addCommand_P(const char *cmd, uint8_t len, CommandCallback cb, void *blind)
+{
+  command_t *c = addCommand((char *)cmd, len, cb, blind);
+  
+  if (c != NULL)
+    c->flags |= CMD_PROGMEM;
+  return c;
+}
+
+command_t *TinyREST::addCommand_P(const char *cmd, uint8_t len, CommandCallback cb) {
+  return addCommand_P(cmd, len, cb, NULL);
+}
+
+
 // Remove an existing command from the list of commands that we
 // are listening to.  Note that we test on pointers, so you will
 // have to use findCommand() before removing a command in most
@@ -615,12 +2023,19 @@ boolean TinyREST::removeCommand(command_t *cmd) {
   return found;
 }
 
+// Compare the name of a command to a (RAM) string, case insensitive.
+boolean TinyREST::matchCommand(command_t *c, char *cmd) {
+  if (c->flags & CMD_PROGMEM)
+    return strcasecmp_P(cmd, c->cmd)==0;
+  return strcasecmp(c->cmd, cmd)==0;
+}
+
 // find a command which name and number of arguments matches the
 // arguments to the method and return a pointer to its structure,
 // NULL if not found or no match.
 command_t *TinyREST::findCommand(char *cmd, uint8_t len) {
   for (uint8_t i=0; i<cmd_count; i++) {
-    if (strcasecmp(cmds[i].cmd, cmd)==0 && cmds[i].len == len) {
+    if (cmds[i].len == len && matchCommand(&cmds[i], cmd)) {
       return &cmds[i];
     }
   }
@@ -635,7 +2050,7 @@ command_t *TinyREST::findCommand(char *cmd, uint8_t len) {
 // return the first matching one.
 command_t *TinyREST::findCommand(char *cmd) {
   for (uint8_t i=0; i<cmd_count; i++) {
-    if (strcasecmp(cmds[i].cmd, cmd)==0) {
+    if (matchCommand(&cmds[i], cmd)) {
       return &cmds[i];
     }
   }
@@ -694,46 +2109,306 @@ int TinyREST::parseCommand(char *URL, command_t *req, char *args[])
 // subscription callbacks. Calling this is essential if you want
 // to be able to receive some callbacks.
 void TinyREST::loop() {
+  loop(0);
+}
+
+// Same as above, but give up testing watches once budget (in
+// microseconds) has been spent, so that a burst of due watches
+// cannot delay WiServer.server_task() for too long.  Watches are
+// visited round-robin and the next call resumes where this one
+// stopped, so that all watches eventually get their turn.  A budget
+// of 0 means no limit.  Loops that went over budget, and loops that
+// had to leave due watches for later, are counted in loop_overruns and
+// loop_deferred.  The budget only covers the watches: the EEPROM write
+// that comes before them, and the retries of callbacks and pushes to
+// peers that come after them, are not charged to it.  Each of these is
+// bounded (one byte, one request per free responder, one batch per
+// peer).
+void TinyREST::loop(unsigned long budget) {
+#ifdef HAVE_EEPROM
+  // Perform the next queued write to the EEPROM, if it is ready.
+  flushEEPROM();
+#endif
+#ifdef HAVE_PERSIST
+  // Go on writing the staged record of the persistent image.
+  persist_flush(false);
+#endif
 #ifdef HAVE_SUBSCRIBE
+  unsigned long start = micros();
   unsigned long now = millis();
   
-  for (uint8_t i=0; i<watch_count; i++) {
-    testWatch(&watchs[i], now);
+  for (uint8_t i=0; i<MAX_WATCHS; i++) {
+    if (watch_next >= MAX_WATCHS) watch_next = 0;
+    vwatch_t *w = &watchs[watch_next++];
+    if (w->type == VALUE_WATCH_NONE)
+      continue;
+    testWatch(w, now);
+    if (budget && (micros() - start) >= budget) {
+      if (micros() - start > budget) loop_overruns++;
+      // Only count a deferral when one of the watches left is due.
+      for (uint8_t j=i+1, k=watch_next; j<MAX_WATCHS; j++, k++) {
+        if (k >= MAX_WATCHS) k = 0;
+        if (watchDue(&watchs[k], now)) {
+          loop_deferred++;
+          break;
+        }
+      }
+      break;
+    }
   }
+  
+  // Retry the callbacks that could not be delivered.
+  retry_pending(this, now);
+#ifdef HAVE_FEDERATION
+  // Push the changes of the shared array to our peers.
+  sync_peers(this, now);
+#endif
+#endif
+}
+
+// Return the number of bytes of RAM that the library uses statically
+// in its current configuration, i.e. the server object and the tables
+// that live outside of it.  Memory allocated for the destinations of
+// subscriptions and the paths of callbacks comes on top.
+unsigned int TinyREST::ramUsage() {
+  unsigned int ram = sizeof(TinyREST);
+#ifdef HAVE_SUBSCRIBE
+  ram += sizeof(cb_list) + sizeof(nullIP) + sizeof(responses)
+    + sizeof(__stream) + sizeof(__response_results)
+    + sizeof(__responder_initialised) + sizeof(__responder_owner)
+    + MAXRESPONDERS * sizeof(REST_GET_REQUEST) + sizeof(REST_POST_REQUEST);
+#endif
+#ifdef HAVE_STATS
+  ram += sizeof(stats);
+#endif
+#ifdef HAVE_PERSIST
+  ram += sizeof(persist_stage) + sizeof(persist_stage_addr)
+    + sizeof(persist_stage_len) + sizeof(persist_stage_done);
+#endif
+  return ram;
+}
+
+#ifdef HAVE_MEM
+// Print a pair of used and total entries of a table.
+static void print_usage(char *buffer, const char *name, int used, int len) {
+  REST_OUT.print_P(name);
+  sprintf(buffer, "[%d,%d],", used, len);
+  REST_OUT.print(buffer);
+}
+
+// Respond the state of the memory: static RAM used by the library, free
+// heap, largest block that can be allocated and headroom left for the
+// stack, together with the occupancy of the tables of the library.  The
+// callbacks in flight and the heap change from one call to the next, so
+// the figures are printed from the snapshot taken on the first call.
+void TinyREST::respond_mem() {
+  boolean fresh;
+  snapshot_t *s = takeSnapshot(&fresh);
+  
+  if (s == NULL) {
+    send_busy();
+    return;
+  }
+  if (fresh) {
+    s->mem.free = freeMemory();
+    s->mem.largest = largestFreeBlock();
+    s->mem.stack = stackHeadroom();
+#ifdef HAVE_SUBSCRIBE
+    s->mem.watchs = watch_count;
+    s->mem.servers = server_count;
+    s->mem.responders = 0;
+    for (uint8_t i=0; i<MAXRESPONDERS; i++) {
+      if (responses[i].status == RESPONDER_SENT)
+        s->mem.responders++;
+    }
+    s->mem.destinations = 0;
+    for (struct cb_info *cb = cb_list; cb != NULL; cb = cb->next)
+      s->mem.destinations++;
+#endif
+#ifdef HAVE_RULES
+    s->mem.rules = 0;
+    for (uint8_t i=0; i<MAX_RULES; i++) {
+      if (rules[i].type != VALUE_WATCH_NONE)
+        s->mem.rules++;
+    }
+#endif
+#ifdef HAVE_EEPROM
+    s->mem.queue = eeprom_queued;
+#endif
+    s->mem.cmds = cmd_count;
+  }
+  
+  REST_OUT.print_P(JSON_RESPONSE);
+  REST_OUT.print('{');
+  REST_OUT.print_P(JSON_RAM);
+  sprintf(buffer, "%u,", ramUsage());
+  REST_OUT.print(buffer);
+  REST_OUT.print_P(JSON_FREE);
+  sprintf(buffer, "%u,", s->mem.free);
+  REST_OUT.print(buffer);
+  REST_OUT.print_P(JSON_LARGEST);
+  sprintf(buffer, "%u,", s->mem.largest);
+  REST_OUT.print(buffer);
+  REST_OUT.print_P(JSON_STACK);
+  sprintf(buffer, "%u,", s->mem.stack);
+  REST_OUT.print(buffer);
+#ifdef HAVE_SUBSCRIBE
+  print_usage(buffer, JSON_WATCHS, s->mem.watchs, MAX_WATCHS);
+  print_usage(buffer, JSON_SERVERS, s->mem.servers, MAX_SERVERS);
+  print_usage(buffer, JSON_RESPONDERS, s->mem.responders, MAXRESPONDERS);
+  REST_OUT.print_P(JSON_DEST_COUNT);
+  sprintf(buffer, "%d,", s->mem.destinations);
+  REST_OUT.print(buffer);
+#endif
+#ifdef HAVE_RULES
+  print_usage(buffer, JSON_RULES, s->mem.rules, MAX_RULES);
 #endif
+#ifdef HAVE_EEPROM
+  print_usage(buffer, JSON_QUEUE, s->mem.queue, EEPROM_QUEUE_LEN);
+#endif
+  REST_OUT.print_P(JSON_COMMANDS);
+  sprintf(buffer, "[%d,%d]", s->mem.cmds, MAX_CMDS);
+  REST_OUT.print(buffer);
+  REST_OUT.print('}');
+  REST_OUT.print('}');
 }
+#endif
+
+#ifdef HAVE_FEDERATION
+// Same as init(), with the identifier of the board among its peers, see
+// SERVER_MODE_PEER.
+void TinyREST::init(uint8_t node_id) {
+  this->node_id = node_id;
+  init();
+}
+#endif
 
 void TinyREST::init() {
+#ifdef HAVE_MEM
+  paintStack();
+#endif
+#ifdef HAVE_FEDERATION
+  if (node_id == 0) {
+    uint8_t ip[4];
+    REST_LOCAL_ADDR(ip);
+    node_id = ip[3];
+  }
+#endif
   // Add standard set of commands.
+  command_t *status = this->addCommand_P(cmd_status, 2, cmd_dispatcher);
+#ifdef HAVE_STATS
+  command_t *read_stats = this->addCommand_P(cmd_stats, 0, cmd_dispatcher);
+#endif
+#ifdef HAVE_MEM
+  command_t *mem = this->addCommand_P(cmd_mem, 0, cmd_dispatcher);
+#endif
 #ifdef HAVE_SHARED
-  command_t *read_shared = this->addCommand(cmd_read_shared, 0, cmd_dispatcher);
-  command_t *read_shared_single = this->addCommand(cmd_read_shared, 1, cmd_dispatcher);
-  command_t *write_shared = this->addCommand(cmd_write_shared, 2, cmd_dispatcher);
-#endif
-  command_t *read_eeprom = this->addCommand(cmd_read_eeprom, 2, cmd_dispatcher);
-  command_t *read_eeprom_single = this->addCommand(cmd_read_eeprom, 1, cmd_dispatcher);
-  command_t *write_eeprom = this->addCommand(cmd_write_eeprom, 2, cmd_dispatcher);
-  command_t *read_dpin = this->addCommand(cmd_read_dpin, 1, cmd_dispatcher);
-  command_t *write_dpin = this->addCommand(cmd_write_dpin, 2, cmd_dispatcher);
-  command_t *dpin_mode = this->addCommand(cmd_dpin_mode, 2, cmd_dispatcher);
-  command_t *read_apin = this->addCommand(cmd_read_apin, 1, cmd_dispatcher);
+  command_t *read_shared = this->addCommand_P(cmd_read_shared, 0, cmd_dispatcher);
+  command_t *read_shared_single = this->addCommand_P(cmd_read_shared, 1, cmd_dispatcher);
+  command_t *write_shared = this->addCommand_P(cmd_write_shared, 2, cmd_dispatcher);
+#endif
+#ifdef HAVE_FEDERATION
+  command_t *sync_shared = this->addCommand_P(cmd_sync_shared, 2, cmd_dispatcher);
+#endif
+#ifdef HAVE_EEPROM
+  command_t *read_eeprom = this->addCommand_P(cmd_read_eeprom, 2, cmd_dispatcher);
+  command_t *read_eeprom_single = this->addCommand_P(cmd_read_eeprom, 1, cmd_dispatcher);
+  command_t *read_eeprom_page = this->addCommand_P(cmd_read_eeprom, 3, cmd_dispatcher);
+  command_t *write_eeprom = this->addCommand_P(cmd_write_eeprom, 2, cmd_dispatcher);
+#endif
+#ifdef HAVE_PINS
+  command_t *read_dpin = this->addCommand_P(cmd_read_dpin, 1, cmd_dispatcher);
+  command_t *write_dpin = this->addCommand_P(cmd_write_dpin, 2, cmd_dispatcher);
+  command_t *dpin_mode = this->addCommand_P(cmd_dpin_mode, 2, cmd_dispatcher);
+  command_t *read_apin = this->addCommand_P(cmd_read_apin, 1, cmd_dispatcher);
+  command_t *write_apin = this->addCommand_P(cmd_write_apin, 2, cmd_dispatcher);
+  command_t *write_dpin_mask = this->addCommand_P(cmd_write_dpin_mask, 3, cmd_dispatcher);
+  command_t *dpin_mode_mask = this->addCommand_P(cmd_dpin_mode_mask, 3, cmd_dispatcher);
+#endif
 #ifdef HAVE_SUBSCRIBE
-  command_t *subscribe = this->addCommand(cmd_subscribe, 5, cmd_dispatcher);
-  command_t *subscribe_nofreq = this->addCommand(cmd_subscribe, 4, cmd_dispatcher);
-  command_t *unsubscribe = this->addCommand(cmd_unsubscribe, 2, cmd_dispatcher);
-  command_t *add_server = this->addCommand(cmd_add_server, 3, cmd_dispatcher);
-  command_t *remove_server = this->addCommand(cmd_remove_server, 1, cmd_dispatcher);
+  command_t *subscribe = this->addCommand_P(cmd_subscribe, 5, cmd_dispatcher);
+  command_t *subscribe_nofreq = this->addCommand_P(cmd_subscribe, 4, cmd_dispatcher);
+  command_t *subscribe_local = this->addCommand_P(cmd_subscribe, 2, cmd_dispatcher);
+  command_t *subscribe_local_freq = this->addCommand_P(cmd_subscribe, 3, cmd_dispatcher);
+  command_t *unsubscribe = this->addCommand_P(cmd_unsubscribe, 2, cmd_dispatcher);
+  command_t *unsubscribe_server = this->addCommand_P(cmd_unsubscribe, 3, cmd_dispatcher);
+  command_t *wait = this->addCommand_P(cmd_wait, 0, cmd_dispatcher);
+  command_t *wait_since = this->addCommand_P(cmd_wait, 1, cmd_dispatcher);
+  command_t *add_server = this->addCommand_P(cmd_add_server, 3, cmd_dispatcher);
+  command_t *add_server_mode = this->addCommand_P(cmd_add_server, 4, cmd_dispatcher);
+  command_t *remove_server = this->addCommand_P(cmd_remove_server, 1, cmd_dispatcher);
+#endif
+#ifdef HAVE_RULES
+  command_t *add_rule = this->addCommand_P(cmd_add_rule, 5, cmd_dispatcher);
+  command_t *remove_rule = this->addCommand_P(cmd_remove_rule, 1, cmd_dispatcher);
+#endif
+#ifdef HAVE_ADMISSION
+  // Commands with long responses cost more.
+  if (status) status->cost = ADMIT_COST_HEAVY;
+#ifdef HAVE_EEPROM
+  if (read_eeprom) read_eeprom->cost = ADMIT_COST_HEAVY;
+  if (read_eeprom_page) read_eeprom_page->cost = ADMIT_COST_HEAVY;
+#endif
+#endif
+#ifdef HAVE_PERSIST
+  // Restore servers and subscriptions from before the last reset.
+  persist_load(this);
 #endif
 }
 
-TinyREST::TinyREST() {
+template <> const uint8_t TinyRESTLayout<sizeof(TinyREST)>::check = 0;
+
+void TinyREST::construct(uint8_t layout) {
   this->cmd_count = 0;
+  this->request = NULL;
+  this->request_next = 0;
+  for (int i=0; i<MAX_REQUESTS; i++)
+    requests[i].conn = NULL;
+  this->loop_overruns = 0;
+  this->loop_deferred = 0;
+#ifdef HAVE_SNAPSHOT
+  this->snapshot_owner = NULL;
+  this->snapshot_used = 0;
+#endif
 #ifdef HAVE_SUBSCRIBE
   this->watch_count = 0;
+  this->watch_next = 0;
+  for (int i=0; i<MAX_WATCHS; i++) {
+    watchs[i].type = VALUE_WATCH_NONE;
+    watchs[i].gen = 0;
+    watchs[i].next = (i < MAX_WATCHS-1) ? i+1 : WATCH_NONE;
+  }
+  this->watch_free = 0;
+  for (int i=0; i<WATCH_INDEX_LEN; i++)
+    watch_index[i] = WATCH_NONE;
+  this->change_seq = 0;
+  for (int i=0; i<CHANGE_LOG_LEN; i++)
+    changes[i].seq = 0;
   this->server_count = 0;
 #endif
+#ifdef HAVE_RULES
+  for (int i=0; i<MAX_RULES; i++)
+    rules[i].type = VALUE_WATCH_NONE;
+#endif
+#ifdef HAVE_EEPROM
+  this->eeprom_queued = 0;
+#endif
+#ifdef HAVE_ADMISSION
+  admit_global.tokens = ADMIT_GLOBAL_BURST;
+  admit_global.last = 0;
+  for (int i=0; i<ADMIT_CLIENTS; i++) {
+    memset(admit_clients[i].ip, 0, 4);
+    admit_clients[i].tokens = ADMIT_BURST;
+    admit_clients[i].last = 0;
+  }
+#endif
 #ifdef HAVE_SHARED
   for (int i=0; i<SHARED_LEN; i++)
     shared[i] = 0;
 #endif
+#ifdef HAVE_FEDERATION
+  for (int i=0; i<SHARED_LEN; i++)
+    shared_version[i] = 0;
+  this->node_id = 0;
+#endif
 };
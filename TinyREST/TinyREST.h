@@ -33,6 +33,33 @@
 //
 // The commands that the server implements are the following:
 //
+// stats (with TINYREST_STATS)
+//   return statistics on the handling of requests: number of requests,
+//   longest handling time and histogram of handling times (in buckets
+//   of 128us, 256us, ... up to the last one), callbacks delivered,
+//   failed and dropped, allocations and frees made by the library, and
+//   requests rejected by the admission control.  These are raw counters
+//   only: percentiles of handling times are not computed, and can only
+//   be read off the histogram to within a factor of two.  Fragmentation
+//   of the heap is not measured either, compare the free heap with its
+//   largest free block in the answer to mem for that.  The answer is
+//   busy while another wait, status, stats or mem is being sent.
+// mem
+//   return the static RAM used by the library, the free heap and its
+//   largest free block, the smallest room left for the stack since
+//   init() (on AVR), and the occupancy of the tables of the library as
+//   [<used>,<capacity>] pairs.  The answer is busy while another wait,
+//   status, stats or mem is being sent.
+// status <offset> <limit>
+//   return <limit> items of the status (commands, subscriptions and
+//   servers, numbered in that order) from <offset>, together with the
+//   offset of the next page if there are more items.  The answer is
+//   busy while another wait, status, stats or mem is being sent.
+// eeprom_read <start> <end>
+// eeprom_read <start> <end> <limit>
+//   return at most <limit> (EEPROM_PAGE by default) bytes, and the
+//   address to continue from when the range was cut.
+//
 // subscribe <type> <position> <server> <path>
 //   where  <type> is one of  0: digital pin
 //                            1: analogue pin
@@ -41,36 +68,360 @@
 //          <position> is a positive integer specifying which value to watch
 //          <server> is the identifier of the server, see below
 //          <path> is an escaped path where to receive the callback at server
+//   subscribing the same value for several servers shares the same
+//   watch, each server being a destination of that watch.  Subscribing
+//   again for the same server changes the path.  With HAVE_PERSIST, the
+//   answer has "saved":false when there was no room left to keep the
+//   subscription across resets.
 // subscribe <type> <position> <server> <freq> <path>
+//   where  <freq> is the time between samples in millisecs, or
+//          <min>:<max> to sample every <min> millisecs after a change
+//          and less and less often, down to every <max> millisecs, as
+//          long as the value does not change.  The current time
+//          between samples is the "frequency" of the status.
+// subscribe <type> <position>
+// subscribe <type> <position> <freq>
+//   watch a value without any callback, its changes are only
+//   available through the wait command.
 // unsubscribe <type> <position>
+// unsubscribe <type> <position> <server>
+//   remove one destination only, the watch is removed together with
+//   its last destination.
+// wait
+// wait <seq>
+//   return the changes of subscribed values which sequence number is
+//   greater than <seq> (all known changes without it), together with
+//   the sequence number of the last change.  The answer is immediate,
+//   with no changes when there are none.  This allows clients that
+//   cannot be reached (NAT) to follow changes by polling.  The answer
+//   is busy while another wait, status, stats or mem is being sent.
+// dpin_write_mask <port> <mask> <value>
+// dpin_mode_mask <port> <mask> <modes>
+//   where  <port> is the letter of an I/O port of the chip (e.g. B, C
+//                 or D on the ATmega328)
+//   set the pins of the port which bits are in <mask> at once, to the
+//   matching bits of <value> (1 for HIGH), or of <modes> (1 for INPUT,
+//   as for dpin_mode).  A <mask> with pins used by the transport (the
+//   SPI and interrupt pins of the WiShield) is refused.
+// apin_write <pin> <value>
+//   output a PWM signal of duty cycle <value> (0 to 255) on <pin>, which
+//   cannot be one of the pins used by the transport.
+//
+// server_add <id> <ip> <port>
+// server_add <id> <ip> <port> <mode>
+//   where  <mode> is one of  0: one GET request per value change
+//                            1: changes streamed as lines in a POST
+//                            2: peer, see shared_sync (with
+//                               TINYREST_FEDERATION)
+// server_remove <id>
+//   a server added with mode 2 is a peer, it receives the changes
+//   to the shared array rather than callbacks.
+// shared_sync <origin> <changes> (with TINYREST_FEDERATION)
+//   apply changes to the shared array sent by the peer <origin>, where
+//   <changes> is a list of <slot>.<version>.<value> separated by "_".
+// rule_add <type> <position> <op> <threshold> <action> (with TINYREST_RULES)
+//   where  <type> and <position> are as for subscribe
+//          <op> is one of gt, lt, eq or ne
+//          <action> is d<pin>=<value> to write a digital pin or
+//                      s<slot>=<value> to write the shared array
+//   perform the action on the board, as soon as a change of the value
+//   makes the comparison with <threshold> true.  Returns the identifier
+//   of the rule.
+// rule_remove <id>
 // 
 // The class provides an API for adding new commands if ever
 // you wanted to do that.
 
+#ifndef TinyREST_h
+#define TinyREST_h
+
+// The platform provides the part of the Arduino core that the library
+// uses: the boolean and byte types, millis() and micros(), the pin
+// functions (pinMode(), digitalRead(), digitalWrite(), analogRead() and
+// analogWrite()) and the port tables of pins_arduino.h
+// (digitalPinToPort(), digitalPinToBitMask(), portOutputRegister(),
+// portModeRegister() and NUM_DIGITAL_PINS), SREG and cli(), the EEPROM
+// (EEPROM.read(), EEPROM.write(), eeprom_is_ready() and E2END), the
+// program memory helpers (PROGMEM, PSTR(), pgm_read_byte() and
+// strcasecmp_P()), strlcpy() and, with TINY_REST_DEBUG, Serial.  It is
+// the Arduino core by default.  Another platform, e.g. Linux, can be
+// used by defining TINY_REST_PLATFORM to the name of a header which
+// provides the same, see extras/posix.
+#ifdef TINY_REST_PLATFORM
+#include TINY_REST_PLATFORM
+#else
+#include <WProgram.h>
+#include <EEPROM.h>
+#include <avr/eeprom.h>
+#include "pins_arduino.h"
+#endif
+
+// The transport is the HTTP server that the responses are printed to
+// and the HTTP client that performs the callbacks.  It is WiServer by
+// default.  Another transport, e.g. a socket server on a Linux gateway,
+// can be used by defining TINY_REST_TRANSPORT to the name of a header
+// which provides the same macros as below, see extras/posix:
+//
+// REST_OUT                  object with print(), print_P() and println()
+//                           methods, where the responses are printed.
+// REST_GET_REQUEST          class of the callback GET requests, built
+//                           with (ip, port, host, URL) and offering
+//                           setReturnFunc(), submit() and isActive().
+//                           Its hostName and URL members (char *) are
+//                           assigned before each submit(), and must be
+//                           used from there on, not the ones given to
+//                           the constructor.  Both stay valid until the
+//                           request is no longer active.
+// REST_POST_REQUEST         same for the streamed POST requests, built
+//                           with (ip, port, host, URL, body function).
+//                           The body function prints the body to
+//                           REST_OUT, and may be called several times
+//                           for the same request.  Only hostName is
+//                           assigned before each submit().
+// REST_RETURN_FUNC          type of the functions receiving responses,
+//                           void (*)(char *data, int len).  They are
+//                           called with the data of the response as it
+//                           arrives, then once with NULL when the
+//                           connection is closed, has failed or has
+//                           timed out, which ends the request.
+// REST_SET_TARGET(r,ip,port) point a request at an IP address (array of
+//                           4 bytes) and port (host order).
+// REST_CLIENT_ADDR(a)       copy the IP address of the client of the
+//                           request being handled into an array of 4
+//                           bytes.
+// REST_LOCAL_ADDR(a)        copy the IP address of the board into an
+//                           array of 4 bytes.
+// REST_CONNECTION()         identifier (void *) of the connection of the
+//                           request being handled.
+// REST_NEW_REQUEST()        true when the request has just arrived, false
+//                           when handleURL() is called again to generate
+//                           the next segments of the response or to
+//                           retransmit one.
+// REST_CONNECTION_OPEN(c)   true while the connection c, as given by
+//                           REST_CONNECTION(), may still ask for segments
+//                           of its response.
+// REST_RESERVED_PIN(pin)    true for the digital pins that the transport
+//                           uses, which commands refuse to touch.
+#ifdef TINY_REST_TRANSPORT
+#include TINY_REST_TRANSPORT
+#else
 #include <WiServer.h>
 #include <WiShield.h>
-#include <EEPROM.h>
 
-#ifndef TinyREST_h
-#define TinyREST_h
+#define REST_OUT            WiServer
+#define REST_GET_REQUEST    GETrequest
+#define REST_POST_REQUEST   POSTrequest
+#define REST_RETURN_FUNC    returnFunction
+#define REST_SET_TARGET(r, ip, p) do { \
+    uip_ipaddr(&(r)->ipAddr, (ip)[0], (ip)[1], (ip)[2], (ip)[3]); \
+    (r)->port = htons(p); \
+  } while (0)
+#define REST_CLIENT_ADDR(a) memcpy((a), uip_conn->ripaddr, 4)
+#define REST_LOCAL_ADDR(a)  memcpy((a), uip_hostaddr, 4)
+#define REST_CONNECTION()   ((void *)uip_conn)
+#define REST_NEW_REQUEST()  uip_newdata()
+#define REST_CONNECTION_OPEN(c) \
+  ((((struct uip_conn *)(c))->tcpstateflags & UIP_TS_MASK) == UIP_ESTABLISHED)
+// The WiShield talks SPI on pins 10 (SS) to 13 (SCK), i.e. PB2 to PB5 on
+// the ATmega328, and interrupts on pin 2 (INT0).
+#define REST_RESERVED_PIN(pin) ((pin) == 2 || ((pin) >= 10 && (pin) <= 13))
+#endif
+#ifndef REST_RESERVED_PIN
+#define REST_RESERVED_PIN(pin) (false)
+#endif
+#ifndef REST_CONNECTION_OPEN
+#define REST_CONNECTION_OPEN(c) (true)
+#endif
 
 //#define TINY_REST_DEBUG
 
+// The features below are compiled in only when their constant is
+// defined, comment them out to strip the matching commands, tables and
+// strings from the library and save on RAM and flash.  The features of
+// the original library are on, each of them can be left out at compile
+// time by defining TINYREST_NO_<feature>, e.g. -DTINYREST_NO_PINS.  The
+// features that change the behaviour seen by existing clients, or that
+// cost much RAM, are off, each of them is brought in by defining
+// TINYREST_<feature>, e.g. -DTINYREST_STATS.  Neither needs touching
+// this file.
+//
 // When defined, the HAVE_SUBSCRIBE constant enables subscriptions to
 // value changes and server definitions.
+#ifndef TINYREST_NO_SUBSCRIBE
 #define HAVE_SUBSCRIBE
+#endif
 // When defined, the HAVE_SHARED constant controls the ability for the
 // server to have a shared array for sharing data between federations of
 // servers.
+#ifndef TINYREST_NO_SHARED
 #define HAVE_SHARED
+#endif
+// When defined, the HAVE_PINS constant enables the commands to read and
+// write the digital and analogue pins.
+#ifndef TINYREST_NO_PINS
+#define HAVE_PINS
+#endif
+// When defined, the HAVE_EEPROM constant enables the commands to read
+// and write the EEPROM.
+#ifndef TINYREST_NO_EEPROM
+#define HAVE_EEPROM
+#endif
+// When defined, the HAVE_PERSIST constant arranges for the servers and
+// subscriptions made through commands to be kept in a reserved area at
+// the end of the EEPROM, and to be restored by init() after a reset.
+// It is off unless TINYREST_PERSIST is defined, because it takes over
+// the last PERSIST_LEN bytes of the EEPROM: 274 bytes with the default
+// sizes, i.e. addresses 750 to 1023 of the 1KB EEPROM of an ATmega328.
+// Whatever the sketch kept there is WIPED OUT by the first init(), and
+// eeprom_write refuses to write there.
+#if defined(TINYREST_PERSIST) && defined(HAVE_SUBSCRIBE)
+#define HAVE_PERSIST
+#endif
+// When defined, the HAVE_STATS constant enables the collection of
+// statistics on request handling times, callbacks and memory
+// allocations, see the stats command.  It is off unless TINYREST_STATS
+// is defined.
+#ifdef TINYREST_STATS
+#define HAVE_STATS
+#endif
+// When defined, the HAVE_FEDERATION constant enables the replication of
+// the shared array to peers, i.e. servers added with the peer mode.  It
+// is off unless TINYREST_FEDERATION is defined.
+#if defined(HAVE_SHARED) && defined(HAVE_SUBSCRIBE) \
+    && defined(TINYREST_FEDERATION)
+#define HAVE_FEDERATION
+#endif
+// When defined, the HAVE_MEM constant enables the mem command, and the
+// painting of the free RAM by init() so as to measure the stack usage.
+#ifndef TINYREST_NO_MEM
+#define HAVE_MEM
+#endif
 
+// When defined, the HAVE_RULES constant enables rules, i.e. actions
+// performed by the board itself when watched values cross thresholds.
+// It is off unless TINYREST_RULES is defined.
+#if defined(HAVE_SUBSCRIBE) && defined(TINYREST_RULES)
+#define HAVE_RULES
+#endif
+
+// When defined, the HAVE_ADMISSION constant enables the admission
+// control of incoming requests, see below.  It is off unless
+// TINYREST_ADMISSION is defined, since clients that go over the rates
+// below, peers included, get busy answers.
+#ifdef TINYREST_ADMISSION
+#define HAVE_ADMISSION
+#endif
+
+// Capacities, these can also be given at compile time (e.g.
+// -DMAX_WATCHS=8) without touching this file. Only give them, and the
+// TINYREST_* flags above, as global flags seen by both the library and
+// the sketch: defining them in the sketch before including this file
+// changes the layout of TinyREST for the sketch only, and the sketch
+// then fails to link (see TinyRESTLayout below).
 #ifdef HAVE_SHARED
+#ifndef SHARED_LEN
 #define SHARED_LEN   (16)
 #endif
-#define MAX_CMDS     (18)
+#endif
+#ifndef MAX_WATCHS
 #define MAX_WATCHS   (5)
+#endif
+#ifndef MAX_SERVERS
 #define MAX_SERVERS  (2)
+#endif
+#ifdef HAVE_RULES
+#ifndef MAX_RULES
+#define MAX_RULES    (4)
+#endif
+#endif
+#ifndef NUM_DIGITAL_PINS
+#define NUM_DIGITAL_PINS (20)  // Digital pins of the ATmega328 boards
+#endif
+#ifndef MAX_USER_CMDS
+#define MAX_USER_CMDS (2)  // Room for commands added by the sketch
+#endif
 #define BUFSIZE      (16)  // Size of buffer for conversions, room for an IP adr
+#ifndef MAXPATH
+#define MAXPATH      (48)  // Max length of callback paths
+#endif
+#ifndef EEPROM_PAGE
+#define EEPROM_PAGE  (64)  // Max nb of bytes returned by eeprom_read
+#endif
+#ifdef HAVE_EEPROM
+// Writes to the EEPROM through writeEEPROM() are queued, and performed
+// one byte at a time from loop() whenever the EEPROM is ready, since a
+// write takes about 3.3ms.  Bytes that are still queued are read from
+// the queue by readEEPROM(), so readers always see the last value
+// written.
+#ifndef EEPROM_QUEUE_LEN
+#define EEPROM_QUEUE_LEN (8)
+#endif
+
+typedef struct eeprom_write {
+  int address;
+  uint8_t value;
+} eeprom_write_t;
+#endif
+
+#ifdef HAVE_PERSIST
+// The persistent image is made of a header (magic, version and sizes)
+// followed by PERSIST_SERVERS server records and PERSIST_SUBS
+// subscription records.  Each record has its own checksum, so that
+// records can be updated one at a time.  The image sits at the end of
+// the EEPROM, from PERSIST_BASE, and cannot be written with eeprom_write.
+// With the default sizes, PERSIST_LEN is 6 + 2 * 10 + 4 * 62 = 274.
+#ifndef PERSIST_SUBS
+#define PERSIST_SUBS    (4)
+#endif
+#define PERSIST_SERVERS (MAX_SERVERS)
+#define PERSIST_VERSION (2)
+#define PERSIST_HEADER_LEN  (6)
+#define PERSIST_SERVER_LEN  (10)
+#define PERSIST_SUB_LEN     (14 + MAXPATH)
+#define PERSIST_LEN     (PERSIST_HEADER_LEN \
+                         + PERSIST_SERVERS * PERSIST_SERVER_LEN \
+                         + PERSIST_SUBS * PERSIST_SUB_LEN)
+#define PERSIST_BASE    (E2END + 1 - PERSIST_LEN)
+#endif
+
+// The table of commands is sized to fit exactly the commands of the
+// features that are compiled in, plus MAX_USER_CMDS.
+#ifdef HAVE_FEDERATION
+#define CMDS_SHARED     (4)
+#elif defined(HAVE_SHARED)
+#define CMDS_SHARED     (3)
+#else
+#define CMDS_SHARED     (0)
+#endif
+#ifdef HAVE_PINS
+#define CMDS_PINS       (7)
+#else
+#define CMDS_PINS       (0)
+#endif
+#if defined(HAVE_STATS) && defined(HAVE_MEM)
+#define CMDS_BASE       (3)
+#elif defined(HAVE_STATS) || defined(HAVE_MEM)
+#define CMDS_BASE       (2)
+#else
+#define CMDS_BASE       (1)
+#endif
+#ifdef HAVE_EEPROM
+#define CMDS_EEPROM     (4)
+#else
+#define CMDS_EEPROM     (0)
+#endif
+#ifdef HAVE_SUBSCRIBE
+#define CMDS_SUBSCRIBE  (11)
+#else
+#define CMDS_SUBSCRIBE  (0)
+#endif
+#ifdef HAVE_RULES
+#define CMDS_RULES      (2)
+#else
+#define CMDS_RULES      (0)
+#endif
+#define MAX_CMDS     (CMDS_BASE + CMDS_SHARED + CMDS_PINS + CMDS_EEPROM \
+                      + CMDS_SUBSCRIBE + CMDS_RULES + MAX_USER_CMDS)
 
 class TinyREST;
 
@@ -81,9 +432,14 @@ class TinyREST;
 typedef int (*CommandCallback)(TinyREST *, char *, int, char **, void *);
 
 #define MAXARGS    5          // Maximum number of arguments to commands.
+#define CMD_PROGMEM (0x01)    // Name of the command is in PROGMEM
 typedef struct command {
   char *cmd;                  // Command
   uint8_t len;                // Number of arguments to command
+  uint8_t flags;              // CMD_ flags above
+#ifdef HAVE_ADMISSION
+  uint8_t cost;               // Tokens taken by a request, see admit()
+#endif
   CommandCallback callback;   // Function to callback on match
   void *blind;                // Blind argument
 } command_t;
@@ -97,41 +453,315 @@ typedef struct command {
 #define VALUE_WATCH_SHARED (3)
 #endif
 
+#define VALUE_WATCH_NONE (0xFF)   // Type of unused watch slots
+
+// Watches live in fixed slots and are found through an open-addressed
+// index on (type, position), which must be a power of two, larger than
+// MAX_WATCHS and at most 128.  It defaults to at least twice MAX_WATCHS.
+#ifndef WATCH_INDEX_LEN
+#if MAX_WATCHS <= 8
+#define WATCH_INDEX_LEN (16)
+#elif MAX_WATCHS <= 16
+#define WATCH_INDEX_LEN (32)
+#elif MAX_WATCHS <= 32
+#define WATCH_INDEX_LEN (64)
+#else
+#define WATCH_INDEX_LEN (128)
+#endif
+#endif
+#if (WATCH_INDEX_LEN & (WATCH_INDEX_LEN - 1)) || WATCH_INDEX_LEN <= MAX_WATCHS \
+    || WATCH_INDEX_LEN > 128
+#error "WATCH_INDEX_LEN must be a power of two, larger than MAX_WATCHS and at most 128"
+#endif
+#define WATCH_NONE      (0xFF)    // No slot / empty index entry
+#define WATCH_DELETED   (0xFE)    // Index entry of a removed watch
+
+// The time between two samples of a watch, freq, is fixed unless the
+// watch has a freq_max, in which case it is adapted: it is reset to
+// freq_min on every change, and doubled on every sample without change,
+// up to freq_max.
 typedef boolean (*ValueWatchCallback)(TinyREST *, int, int, int, void *);
 typedef struct vwatch {
   int position;
   int value;
   uint8_t type;
-  unsigned long freq;
+  unsigned long freq;             // Current time between samples
+  unsigned long freq_min;         // Time between samples after a change
+  unsigned long freq_max;         // Longest time between samples, or 0
   ValueWatchCallback callback;    // Function to callback on match
   void *blind;                    // Blind argument
   unsigned long lastChecked;      // Last time the value was checked.
+  uint8_t gen;                    // Generation of the slot, for handles
+  uint8_t next;                   // Next watch on same value, or free
 } vwatch_t;
+typedef uint16_t vwatch_handle_t;  // Generation (high) and slot (low)
+
+
+// Failed callbacks are retried with an exponential backoff, starting
+// at BACKOFF_MIN millisecs and doubling up to BACKOFF_MAX_SHIFT times.
+// After SERVER_UNHEALTHY consecutive failures, a server is considered
+// as unhealthy and only gets one request (a probe) at a time.
+#define BACKOFF_MIN        (500)
+#define BACKOFF_MAX_SHIFT  (6)
+#define SERVER_UNHEALTHY   (3)
+
+// Servers receive callbacks either as one GET request per value change
+// (the default), or as a stream of lines, each line being the path and
+// value of a change, POSTed to CALLBACK_STREAM_URL.  All changes that
+// are pending for a stream server are sent in the same request.  A
+// stream server that is unhealthy falls back to GET requests, and gets
+// a stream again once one of them has succeeded.
+// There is only one stream request, for one server at a time, while
+// GET requests go to up to three servers at once: a stream server
+// waits for the slow ones, and gets fewer values than with GET when
+// changes do not pile up (see extras/soak, -m 1).
+#define SERVER_MODE_GET    (0)
+#define SERVER_MODE_STREAM (1)
+#define CALLBACK_STREAM_URL "/"
+
+#ifdef HAVE_FEDERATION
+// Peers are servers which receive the changes of the shared array,
+// batched by at most SYNC_BATCH slots per request.  Every slot has a
+// version, and the last writer wins: a peer only applies a change with
+// a more recent version, or with the same version but coming from a
+// node with a higher node_id, for ties.  Ties only settle when every
+// board has its own node_id: give it to init(node_id), otherwise init()
+// takes the last byte of the IP address of the board, and should thus
+// be called after the network has been set up (e.g. WiServer.init()).
+#define SERVER_MODE_PEER   (2)
+#define SYNC_BATCH         (6)
+#define SYNC_DIRTY_LEN     ((SHARED_LEN + 7) / 8)
+#endif
+
+// Every change of a subscribed value is kept in a log of the last
+// CHANGE_LOG_LEN changes, with a sequence number, for the wait command.
+#ifndef CHANGE_LOG_LEN
+#define CHANGE_LOG_LEN  (8)
+#endif
+
+typedef struct vchange {
+  unsigned int seq;
+  int position;
+  int value;
+  uint8_t type;
+} vchange_t;
+
+#ifdef HAVE_RULES
+// Rules compare the new value of a watched value to a threshold each
+// time it changes, and perform their action when the comparison turns
+// true.  Rules are kept in a table of MAX_RULES entries, unused entries
+// have a type of VALUE_WATCH_NONE.
+#define RULE_GT            (0)
+#define RULE_LT            (1)
+#define RULE_EQ            (2)
+#define RULE_NE            (3)
+#define RULE_ACTION_DPIN   (0)  // Write arg to digital pin target
+#define RULE_ACTION_SHARED (1)  // Write arg to shared slot target
 
+typedef struct rule {
+  int position;
+  int threshold;
+  unsigned int arg;               // Value written by the action
+  uint8_t type;                   // Type of the value, see VALUE_WATCH_
+  uint8_t op;                     // One of the RULE_ comparisons
+  uint8_t action;                 // One of the RULE_ACTION_ constants
+  uint8_t target;                 // Pin or shared slot of the action
+  boolean active;                 // Comparison true at last change
+} rule_t;
+#endif
 
 typedef struct server {
   uint8_t id;
   uint8_t ip[4];
-  char hostName[20];
   unsigned short port;
+  uint8_t mode;                   // One of the SERVER_MODE_ constants.
+  uint8_t failures;               // Consecutive failed callbacks.
+  unsigned long retryAt;          // No callback before that time (or 0)
+#ifdef HAVE_FEDERATION
+  uint8_t dirty[SYNC_DIRTY_LEN];  // Shared slots to push to a peer
+#endif
 } server_t;
 #endif
 
 
+#ifdef HAVE_ADMISSION
+// Requests are admitted through token buckets: a request takes as many
+// tokens as the cost of its command (1 by default, ADMIT_COST_HEAVY for
+// the commands with long responses), and is answered with a short
+// "busy" error when there are not enough tokens left.  Requests are
+// charged once, on arrival, see request_state_t.
+// Every client, recognised by its IP address, has a bucket of
+// ADMIT_BURST tokens, refilled with one token every ADMIT_REFILL
+// millisecs.  The ADMIT_CLIENTS buckets are reused for new clients,
+// least recently seen first.  All requests also take their tokens from
+// a global bucket, so that the board remains responsive to its own
+// watches whatever the number of clients.
+#ifndef ADMIT_CLIENTS
+#define ADMIT_CLIENTS        (4)
+#endif
+#ifndef ADMIT_BURST
+#define ADMIT_BURST          (8)
+#endif
+#ifndef ADMIT_REFILL
+#define ADMIT_REFILL         (100)
+#endif
+#ifndef ADMIT_GLOBAL_BURST
+#define ADMIT_GLOBAL_BURST   (16)
+#endif
+#ifndef ADMIT_GLOBAL_REFILL
+#define ADMIT_GLOBAL_REFILL  (50)
+#endif
+#define ADMIT_COST_HEAVY     (4)
+
+#define ADMIT_PENDING        (0)  // Request not charged yet
+#define ADMIT_OK             (1)  // Request admitted
+#define ADMIT_REFUSED        (2)  // Request answered with busy
+
+typedef struct admit_bucket {
+  uint8_t ip[4];                  // Client, unused for the global bucket
+  uint8_t tokens;
+  unsigned long last;             // Time of last refill
+} admit_bucket_t;
+#endif
+
+// The transport calls handleURL() once per segment of a response, and
+// again for retransmissions, and every call must generate the same
+// response.  What a response depends on is thus kept, per connection,
+// from the call that brought the request, for the last MAX_REQUESTS
+// connections.
+#ifndef MAX_REQUESTS
+#define MAX_REQUESTS (4)
+#endif
+
+typedef struct request_state {
+  void *conn;                     // Connection, see REST_CONNECTION()
+  uint8_t calls;                  // Calls of handleURL() for the request
+#ifdef HAVE_ADMISSION
+  uint8_t admission;              // One of the ADMIT_ constants
+#endif
+} request_state_t;
+
+#ifdef HAVE_STATS
+// Handling times of requests are counted in STATS_BUCKETS buckets, the
+// first one for requests handled in less than 128 microsecs, and each
+// next one for twice as long, the last one taking all the rest.  The
+// counters wrap around, clients watching a board over a long time
+// should look at their differences between two reads.
+#define STATS_BUCKETS (8)
+typedef struct stats {
+  unsigned long requests;         // Requests handled by handleURL()
+  unsigned long request_max;      // Longest handling time (microsecs)
+  unsigned int request_times[STATS_BUCKETS];  // Histogram of times
+  unsigned long delivered;        // Callbacks acknowledged by servers
+  unsigned long failed;           // Callbacks that failed
+  unsigned long dropped;          // Callbacks lost (coalesced or no server)
+  unsigned long allocs;           // Nb of malloc() by the library
+  unsigned long frees;            // Nb of free() by the library
+  unsigned long rejected;         // Requests refused by admission
+} stats_t;
+#endif
+
+// The values that a response prints, and that may change before
+// handleURL() is called again for the same response, are printed from a
+// snapshot taken on the call that brought the request.  There is only
+// one snapshot: it belongs to one request until the connection of that
+// request closes, or until SNAPSHOT_LEASE millisecs after the last call
+// for it.  Requests that need it meanwhile are answered with busy.
+#if defined(HAVE_SUBSCRIBE) || defined(HAVE_STATS) || defined(HAVE_MEM)
+#define HAVE_SNAPSHOT
+#endif
+#ifdef HAVE_SNAPSHOT
+#ifndef SNAPSHOT_LEASE
+#define SNAPSHOT_LEASE (5000)
+#endif
+
+typedef union snapshot {
+#ifdef HAVE_SUBSCRIBE
+  struct {
+    unsigned int last;            // Sequence number of the last change
+    uint8_t count;                // Number of changes in the response
+    boolean lost;                 // Whether changes have been lost
+    vchange_t changes[CHANGE_LOG_LEN];
+  } wait;
+  struct {
+    int value[MAX_WATCHS];        // Values of the watches
+    unsigned long freq[MAX_WATCHS];  // Times between their samples
+    uint8_t failures[MAX_SERVERS];  // Failures of the servers
+#ifdef HAVE_RULES
+    boolean active[MAX_RULES];    // States of the rules
+#endif
+  } status;
+#endif
+#ifdef HAVE_STATS
+  stats_t stats;                  // Counters of the stats command
+#endif
+#ifdef HAVE_MEM
+  struct {
+    unsigned int free;            // Free heap
+    unsigned int largest;         // Largest free block
+    unsigned int stack;           // Headroom left for the stack
+    uint8_t watchs;               // Used entries of the tables
+    uint8_t servers;
+    uint8_t responders;
+    uint8_t rules;
+    uint8_t queue;
+    uint8_t cmds;
+    int destinations;             // Destinations of the subscriptions
+  } mem;
+#endif
+} snapshot_t;
+#endif
+
+// Defined by the library for the size it was built with only, so a
+// sketch seeing a different layout of TinyREST gets an undefined
+// reference from the constructor instead of a corrupted object.
+template <unsigned int size> struct TinyRESTLayout {
+  static const uint8_t check;
+};
+
 class TinyREST {
 public:
 #ifdef HAVE_SHARED
   unsigned int shared[SHARED_LEN];
+#endif
+#ifdef HAVE_FEDERATION
+  uint8_t shared_version[SHARED_LEN];  // Version of each shared slot
+  uint8_t node_id;                // Identifier of this node, for ties
 #endif
   char buffer[BUFSIZE];           // Buffer for conversions to strings.
 
   void init();
+#ifdef HAVE_FEDERATION
+  void init(uint8_t node_id);
+#endif
+  static unsigned int ramUsage();
   boolean handleURL(char *URL);
   void loop();
+  void loop(unsigned long budget);
+
+#ifdef HAVE_STATS
+  static stats_t stats;           // Statistics, see the stats command.
+  void respond_stats();
+#endif
+
+#ifdef HAVE_MEM
+  // Memory instrumentation, see the mem command.
+  static void paintStack();
+  static unsigned int freeMemory();
+  static unsigned int largestFreeBlock();
+  static unsigned int stackHeadroom();
+  void respond_mem();
+#endif
+
+  // Loop-time accounting, see loop(budget).
+  unsigned long loop_overruns;    // Nb of loops that went over budget.
+  unsigned long loop_deferred;    // Nb of loops that left due watches.
   
   // Handling of recognised commands
   command_t *addCommand(char *cmd, uint8_t len, CommandCallback cb, void *blind);
   command_t *addCommand(char *cmd, uint8_t len, CommandCallback cb);
+  command_t *addCommand_P(const char *cmd, uint8_t len, CommandCallback cb, void *blind);
+  command_t *addCommand_P(const char *cmd, uint8_t len, CommandCallback cb);
   boolean removeCommand(command_t *cmd);
   command_t *findCommand(char *cmd);
   command_t *findCommand(char *cmd, uint8_t len);
@@ -144,22 +774,57 @@ public:
   vwatch_t *addWatch(int, uint8_t, ValueWatchCallback); 
   boolean removeWatch(vwatch_t *watch);
   vwatch_t *findWatch(int position, uint8_t type);
+  vwatch_t *nextWatch(vwatch_t *watch);
+  vwatch_handle_t watchHandle(vwatch_t *watch);
+  vwatch_t *lookupWatch(vwatch_handle_t handle);
+  void logChange(vwatch_t *);
+  void setFrequency(vwatch_t *watch, unsigned long min, unsigned long max);
 
   // Handling of remote servers for subscriptions
   server_t *addServer( uint8_t, char *, unsigned short);
+  server_t *addServer( uint8_t, char *, unsigned short, uint8_t);
   boolean removeServer(uint8_t);
   server_t *findServer(uint8_t);
+  server_t *nextServer(server_t *);
+  static char *hostName(server_t *, char *);
+#endif
+#ifdef HAVE_RULES
+  // Handling of rules
+  int addRule(uint8_t type, int position, uint8_t op, int threshold,
+              uint8_t action, uint8_t target, unsigned int arg);
+  boolean removeRule(uint8_t id);
+#endif
+#ifdef HAVE_SHARED
+  void writeShared(uint8_t slot, unsigned int value);
+#endif
+#ifdef HAVE_EEPROM
+  uint8_t readEEPROM(int address);
+  void writeEEPROM(int address, uint8_t value);
+  boolean flushEEPROM();
+#endif
+#ifdef HAVE_FEDERATION
+  boolean syncShared(uint8_t slot, uint8_t version, unsigned int value, uint8_t origin);
+  void markShared(uint8_t slot, server_t *except);
 #endif
   
-  TinyREST();
+  TinyREST() { construct(TinyRESTLayout<sizeof(TinyREST)>::check); }
   void respond_status();
+  void respond_status(int offset, int limit);
+#ifdef HAVE_EEPROM
   void respond_read_eeprom(int start, int end);
+  void respond_read_eeprom(int start, int end, int limit);
+#endif
+#ifdef HAVE_SUBSCRIBE
+  void respond_changes(unsigned int since);
+#endif
   void send_true();
   void send_false();
+  void send_busy();
   void send_int(int val);
   void send_int_arr(unsigned int* arr, int len);
 
 private:
+  void construct(uint8_t layout);
   command_t cmds[MAX_CMDS];       // Commands supported by server
   command_t req;                  // Last incoming request.
   char *req_args[MAXARGS];        // Arguments to last incoming request.
@@ -167,19 +832,59 @@ private:
 #ifdef HAVE_SUBSCRIBE
   vwatch_t watchs[MAX_WATCHS];    // Value watched by the server
   int watch_count;                // Number of values watched
+  uint8_t watch_index[WATCH_INDEX_LEN];  // Slots by (type, position)
+  uint8_t watch_free;             // First free slot in watchs
+  uint8_t watch_next;             // Next watch to test in loop()
   struct server servers[MAX_SERVERS];  // List of known servers for callbacks.
   int server_count;               // Current number of servers.
+  vchange_t changes[CHANGE_LOG_LEN];  // Log of last changes (ring)
+  unsigned int change_seq;        // Sequence number of last change
+#endif
+#ifdef HAVE_RULES
+  rule_t rules[MAX_RULES];        // Rules on watched values
+#endif
+#ifdef HAVE_EEPROM
+  eeprom_write_t eeprom_queue[EEPROM_QUEUE_LEN];  // Writes to perform
+  uint8_t eeprom_queued;          // Number of writes in the queue
+#endif
+#ifdef HAVE_ADMISSION
+  admit_bucket_t admit_global;    // Tokens for all clients
+  admit_bucket_t admit_clients[ADMIT_CLIENTS];  // Tokens per client
+#endif
+
+  request_state_t requests[MAX_REQUESTS];  // State of recent requests
+  request_state_t *request;       // State of the request being handled
+  uint8_t request_next;           // Next entry of requests to reuse
+#ifdef HAVE_SNAPSHOT
+  snapshot_t snapshot;            // Values printed by a response
+  request_state_t *snapshot_owner;  // Request that holds the snapshot
+  unsigned long snapshot_used;    // Last time it was used
 #endif
 
+  request_state_t *findRequest();
+#ifdef HAVE_SNAPSHOT
+  snapshot_t *takeSnapshot(boolean *fresh);
+#endif
+  boolean dispatchURL(char *URL);
   int parseCommand(char *URL, command_t *req, char *args[]);
+  boolean matchCommand(command_t *c, char *cmd);
+#ifdef HAVE_ADMISSION
+  boolean admit(uint8_t cost);
+#endif
 #ifdef TINY_REST_DEBUG
   void printCommand(command_t *c, char *header, char *args[]);
 #endif
 #ifdef HAVE_SUBSCRIBE
+  uint8_t findIndex(int position, uint8_t type);
   int getWatch(vwatch_t *w, unsigned long now);
+  boolean watchDue(vwatch_t *, unsigned long now);
   boolean testWatch(vwatch_t *, unsigned long now);
   boolean testWatch(vwatch_t *);
 #endif
+#ifdef HAVE_RULES
+  void runRules(vwatch_t *);
+  void runRule(rule_t *, int value);
+#endif
 };
 
 #endif
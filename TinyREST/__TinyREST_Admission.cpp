@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "TinyREST.h"
+
+#ifdef HAVE_ADMISSION
+// Add the tokens earned by a bucket since its last refill, one every
+// refill millisecs, without going over burst.
+static void refill(admit_bucket_t *b, unsigned long now,
+                   unsigned long refill, uint8_t burst)
+{
+  unsigned long earned = (now - b->last) / refill;
+
+  if (earned >= (unsigned long)(burst - b->tokens)) {
+    b->tokens = burst;
+    b->last = now;
+  } else {
+    b->tokens += earned;
+    b->last += earned * refill;
+  }
+}
+
+// Decide if the request being handled, which command costs cost
+// tokens, should be performed.  The tokens are taken from the bucket of
+// the client and from the global bucket, only when both have enough of
+// them.  The bucket of a new client is the one of the client that was
+// least recently seen, full.  A request is only charged on its first
+// call, the next calls get the same decision.
+boolean TinyREST::admit(uint8_t cost)
+{
+  unsigned long now = millis();
+  uint8_t ip[4];
+  admit_bucket_t *b = NULL;
+
+  if (request->admission != ADMIT_PENDING)
+    return request->admission == ADMIT_OK;
+
+  REST_CLIENT_ADDR(ip);
+  for (uint8_t i=0; i<ADMIT_CLIENTS; i++) {
+    if (memcmp(admit_clients[i].ip, ip, 4) == 0) {
+      b = &admit_clients[i];
+      break;
+    }
+  }
+  if (b == NULL) {
+    b = &admit_clients[0];
+    for (uint8_t i=1; i<ADMIT_CLIENTS; i++) {
+      if (now - admit_clients[i].last > now - b->last)
+        b = &admit_clients[i];
+    }
+    memcpy(b->ip, ip, 4);
+    b->tokens = ADMIT_BURST;
+    b->last = now;
+  }
+
+  refill(b, now, ADMIT_REFILL, ADMIT_BURST);
+  refill(&admit_global, now, ADMIT_GLOBAL_REFILL, ADMIT_GLOBAL_BURST);
+  if (b->tokens < cost || admit_global.tokens < cost) {
+#ifdef HAVE_STATS
+    stats.rejected++;
+#endif
+    request->admission = ADMIT_REFUSED;
+    return false;
+  }
+  b->tokens -= cost;
+  admit_global.tokens -= cost;
+  request->admission = ADMIT_OK;
+  return true;
+}
+#endif
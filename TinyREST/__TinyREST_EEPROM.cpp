@@ -0,0 +1,59 @@
+#include <stdio.h>
+
+#include "TinyREST.h"
+
+#ifdef HAVE_EEPROM
+// Read a byte of the EEPROM, taking into account the writes that are
+// still in the queue.
+uint8_t TinyREST::readEEPROM(int address)
+{
+  for (uint8_t i=0; i<eeprom_queued; i++) {
+    if (eeprom_queue[i].address == address)
+      return eeprom_queue[i].value;
+  }
+  return EEPROM.read(address);
+}
+
+// Queue the write of a byte to the EEPROM.  A write to an address that
+// is already queued replaces the queued value, and writing the value
+// that the EEPROM already holds does nothing, which spares the EEPROM
+// from useless erase cycles.  When the queue is full, the oldest write
+// is performed first, waiting for the EEPROM if necessary.
+void TinyREST::writeEEPROM(int address, uint8_t value)
+{
+  for (uint8_t i=0; i<eeprom_queued; i++) {
+    if (eeprom_queue[i].address == address) {
+      eeprom_queue[i].value = value;
+      return;
+    }
+  }
+  if (EEPROM.read(address) == value)
+    return;
+
+  if (eeprom_queued == EEPROM_QUEUE_LEN) {
+    while (!eeprom_is_ready())
+      ;
+    flushEEPROM();
+  }
+  eeprom_queue[eeprom_queued].address = address;
+  eeprom_queue[eeprom_queued].value = value;
+  eeprom_queued++;
+}
+
+// Perform the oldest queued write if the EEPROM is ready for it, this
+// is called from loop().  Return true if there are writes left.
+boolean TinyREST::flushEEPROM()
+{
+  if (eeprom_queued == 0)
+    return false;
+  if (!eeprom_is_ready())
+    return true;
+
+  if (EEPROM.read(eeprom_queue[0].address) != eeprom_queue[0].value)
+    EEPROM.write(eeprom_queue[0].address, eeprom_queue[0].value);
+  eeprom_queued--;
+  for (uint8_t i=0; i<eeprom_queued; i++)
+    eeprom_queue[i] = eeprom_queue[i+1];
+  return eeprom_queued > 0;
+}
+#endif
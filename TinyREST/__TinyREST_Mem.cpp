@@ -0,0 +1,95 @@
+#include <stdio.h>
+
+#include "TinyREST.h"
+
+#ifdef HAVE_MEM
+#ifdef __AVR__
+// The heap grows up from __heap_start to __brkval, and the stack grows
+// down from the end of the RAM.  Blocks given back to malloc() are kept
+// in the free list __flp of avr-libc.
+extern char __heap_start;
+extern char *__brkval;
+struct __freelist {
+  size_t sz;
+  struct __freelist *nx;
+};
+extern struct __freelist *__flp;
+extern size_t __malloc_margin;
+
+#define STACK_PAINT   (0xC5)     // Value of bytes never used
+#define STACK_MARGIN  (32)       // Bytes below the stack left unpainted
+
+// Return the top of the heap.
+static char *heapEnd()
+{
+  return (__brkval == 0) ? &__heap_start : __brkval;
+}
+#endif
+
+// Fill the RAM between the heap and the stack with STACK_PAINT, so that
+// stackHeadroom() can later tell how deep the stack went.  This is
+// called by init(), the deepest stack should thus be measured after it.
+void TinyREST::paintStack()
+{
+#ifdef __AVR__
+  char here;
+
+  for (char *p = heapEnd(); p < &here - STACK_MARGIN; p++)
+    *p = STACK_PAINT;
+#endif
+}
+
+// Return the number of bytes that the stack has never used since the
+// RAM was painted, i.e. the smallest room that there has been between
+// the heap and the stack.  RAM given back from the top of the heap is
+// not painted again, and counts as used by the stack.
+unsigned int TinyREST::stackHeadroom()
+{
+#ifdef __AVR__
+  char here;
+  char *p = heapEnd();
+
+  while (p < &here && *p == STACK_PAINT)
+    p++;
+  return p - heapEnd();
+#else
+  return 0;
+#endif
+}
+
+// Return the number of bytes free for the heap and the stack: those
+// between them and those of the blocks in the free list.
+unsigned int TinyREST::freeMemory()
+{
+#ifdef __AVR__
+  char here;
+  unsigned int mem = &here - heapEnd();
+
+  for (struct __freelist *f = __flp; f != NULL; f = f->nx)
+    mem += f->sz + sizeof(size_t);
+  return mem;
+#else
+  return 0;
+#endif
+}
+
+// Return the size of the largest block that malloc() could give: the
+// largest one in the free list, or the room between the heap and the
+// stack, less the margin that malloc() keeps for the stack, when larger.
+unsigned int TinyREST::largestFreeBlock()
+{
+#ifdef __AVR__
+  char here;
+  unsigned int gap = &here - heapEnd();
+  unsigned int largest = (gap > __malloc_margin) ? gap - __malloc_margin : 0;
+
+  for (struct __freelist *f = __flp; f != NULL; f = f->nx) {
+    if (f->sz > largest)
+      largest = f->sz;
+  }
+  return largest;
+#else
+  return 0;
+#endif
+}
+#endif
@@ -0,0 +1,150 @@
+#include <stdio.h>
+
+#include "TinyREST.h"
+
+#ifdef HAVE_RULES
+// Add a rule: perform an action as soon as a change of the value of a
+// given type and position makes the comparison op with the threshold
+// true.  The value is watched at every loop.
+// The rule is run once on its addition, so that the action is
+// performed right away if the comparison already holds.  Returns the
+// identifier of the rule, or -1 on problems, among which a target pin
+// that the board does not have or that the transport uses.
+int TinyREST::addRule(uint8_t type, int position, uint8_t op, int threshold,
+                      uint8_t action, uint8_t target, unsigned int arg)
+{
+  vwatch_t *w;
+  rule_t *r = NULL;
+
+  if (op > RULE_NE)
+    return -1;
+  switch (type) {
+    case VALUE_WATCH_DPIN:
+    case VALUE_WATCH_APIN:
+    case VALUE_WATCH_EEPROM:
+#ifdef HAVE_SHARED
+    case VALUE_WATCH_SHARED:
+#endif
+      break;
+    default:
+      return -1;
+  }
+  switch (action) {
+#ifdef HAVE_PINS
+    case RULE_ACTION_DPIN:
+      if (target >= NUM_DIGITAL_PINS || REST_RESERVED_PIN(target))
+        return -1;
+      break;
+#endif
+#ifdef HAVE_SHARED
+    case RULE_ACTION_SHARED:
+      if (target >= SHARED_LEN)
+        return -1;
+      break;
+#endif
+    default:
+      return -1;
+  }
+
+  for (uint8_t i=0; i<MAX_RULES; i++) {
+    if (rules[i].type == VALUE_WATCH_NONE) {
+      r = &rules[i];
+      break;
+    }
+  }
+  if (r == NULL)
+    return -1;
+
+  // The rule has its own watch, without callback, so that it keeps
+  // running whatever happens to subscriptions on the same value.
+  for (w = findWatch(position, type); w != NULL; w = nextWatch(w)) {
+    if (w->callback == NULL)
+      break;
+  }
+  if (w == NULL) {
+    w = addWatch(position, type, 0, NULL, NULL);
+    if (w == NULL)
+      return -1;
+  }
+
+  r->position = position;
+  r->threshold = threshold;
+  r->arg = arg;
+  r->type = type;
+  r->op = op;
+  r->action = action;
+  r->target = target;
+  r->active = false;
+  runRule(r, w->value);
+
+  return r - rules;
+}
+
+// Remove a rule given its identifier.  The watch that was added for the
+// rule, if any, goes with the last rule on its value.
+boolean TinyREST::removeRule(uint8_t id)
+{
+  uint8_t type;
+  int position;
+
+  if (id >= MAX_RULES || rules[id].type == VALUE_WATCH_NONE)
+    return false;
+  type = rules[id].type;
+  position = rules[id].position;
+  rules[id].type = VALUE_WATCH_NONE;
+
+  for (uint8_t i=0; i<MAX_RULES; i++) {
+    if (rules[i].type == type && rules[i].position == position)
+      return true;
+  }
+  // Watches added for rules are the only ones without callback.
+  for (vwatch_t *w = findWatch(position, type); w != NULL; w = nextWatch(w)) {
+    if (w->callback == NULL) {
+      removeWatch(w);
+      break;
+    }
+  }
+  return true;
+}
+
+// Run all the rules on the value of a watch that has just changed.
+// All the watches on the same value run the rules, which is harmless
+// since actions are only performed when a comparison turns true.
+void TinyREST::runRules(vwatch_t *w)
+{
+  for (uint8_t i=0; i<MAX_RULES; i++) {
+    if (rules[i].type == w->type && rules[i].position == w->position)
+      runRule(&rules[i], w->value);
+  }
+}
+
+// Compare a value to the threshold of a rule and perform its action if
+// the comparison has turned true.
+void TinyREST::runRule(rule_t *r, int value)
+{
+  boolean holds = false;
+
+  switch (r->op) {
+    case RULE_GT: holds = (value > r->threshold); break;
+    case RULE_LT: holds = (value < r->threshold); break;
+    case RULE_EQ: holds = (value == r->threshold); break;
+    case RULE_NE: holds = (value != r->threshold); break;
+  }
+
+  if (holds && !r->active) {
+    switch (r->action) {
+#ifdef HAVE_PINS
+      case RULE_ACTION_DPIN:
+        digitalWrite(r->target, r->arg ? HIGH : LOW);
+        break;
+#endif
+#ifdef HAVE_SHARED
+      case RULE_ACTION_SHARED:
+        writeShared(r->target, r->arg);
+        break;
+#endif
+    }
+  }
+  r->active = holds;
+}
+#endif
@@ -1,6 +1,3 @@
-#include <WiServer.h>
-#include <WProgram.h>
-#include <EEPROM.h>
 #include <stdio.h>
 
 #include "TinyREST.h"
@@ -20,14 +17,39 @@ server_t *TinyREST::findServer(uint8_t id)
   return NULL;
 }
 
+// Iterate over the known servers: return the first one when s is NULL,
+// the one after s otherwise, and NULL after the last one.
+server_t *TinyREST::nextServer(server_t *s)
+{
+  uint8_t i = (s == NULL) ? 0 : (s - servers) + 1;
+  
+  if (i >= server_count)
+    return NULL;
+  return &servers[i];
+}
+
 // Add a new server to our list of known server.  If there is
 // already a server with that identifier, the value will be 
 // updated instead.  The ip string should be a properly formatted
-// IPv4 address.
-server_t *TinyREST::addServer(uint8_t id, char *ip, unsigned short port)
+// IPv4 address.  The mode is one of the SERVER_MODE_ constants and
+// decides how callbacks are delivered to the server, NULL is returned
+// for any other mode.
+server_t *TinyREST::addServer(uint8_t id, char *ip, unsigned short port, uint8_t mode)
 {
-  server_t *srv = findServer(id);
+  server_t *srv = NULL;
+  
+  switch (mode) {
+    case SERVER_MODE_GET:
+    case SERVER_MODE_STREAM:
+#ifdef HAVE_FEDERATION
+    case SERVER_MODE_PEER:
+#endif
+      break;
+    default:
+      return NULL;
+  }
   
+  srv = findServer(id);
   if (srv == NULL) {
     if (server_count < MAX_SERVERS) {
       srv = &servers[server_count++];
@@ -35,19 +57,40 @@ server_t *TinyREST::addServer(uint8_t id, char *ip, unsigned short port)
   }
   
   if (srv != NULL) {
-    // Update the server structure.  We arrange for "hostName" to
-    // be a print of the IP address, this will be used when
-    // performing GET request on callbacks.
+    // Update the server structure.  The host name is not kept, it is
+    // printed from the IP address whenever needed, see hostName().
+    unsigned int a[4] = {0,0,0,0};
     srv->id = id;
-    sscanf(ip,"%u.%u.%u.%u",
-              &srv->ip[0], &srv->ip[1], &srv->ip[2], &srv->ip[3]);
-    sprintf(srv->hostName, "%u.%u.%u.%u",
-            srv->ip[0], srv->ip[1], srv->ip[2], srv->ip[3]);
+    sscanf(ip,"%u.%u.%u.%u", &a[0], &a[1], &a[2], &a[3]);
+    for (uint8_t i=0; i<4; i++)
+      srv->ip[i] = a[i];
     srv->port = port;
+    srv->mode = mode;
+    srv->failures = 0;
+    srv->retryAt = 0;
+#ifdef HAVE_FEDERATION
+    // A new peer gets the whole shared array.
+    for (uint8_t i=0; i<SYNC_DIRTY_LEN; i++)
+      srv->dirty[i] = (mode == SERVER_MODE_PEER) ? 0xFF : 0;
+#endif
   }
   return srv;
 }
 
+server_t *TinyREST::addServer(uint8_t id, char *ip, unsigned short port)
+{
+  return addServer(id, ip, port, SERVER_MODE_GET);
+}
+
+// Print the IP address of a server into a string, which should have
+// room for at least 16 characters.  This is the host name used when
+// performing GET request on callbacks.
+char *TinyREST::hostName(server_t *srv, char *str)
+{
+  sprintf(str, "%u.%u.%u.%u", srv->ip[0], srv->ip[1], srv->ip[2], srv->ip[3]);
+  return str;
+}
+
 // REmove a server given its identifier.
 boolean TinyREST::removeServer(uint8_t id)
 {
@@ -0,0 +1,57 @@
+#include <stdio.h>
+
+#include "TinyREST.h"
+
+#ifdef HAVE_SHARED
+// Write a value to the shared array.  This is the way to change the
+// shared array from the sketch, so that the change is replicated to
+// the peers (see HAVE_FEDERATION), if any.
+void TinyREST::writeShared(uint8_t slot, unsigned int value)
+{
+  if (slot >= SHARED_LEN)
+    return;
+  shared[slot] = value;
+#ifdef HAVE_FEDERATION
+  shared_version[slot]++;
+  markShared(slot, NULL);
+#endif
+}
+#endif
+
+#ifdef HAVE_FEDERATION
+// Mark a slot of the shared array as having to be pushed to all peers
+// but one (the one the change came from, if any).
+void TinyREST::markShared(uint8_t slot, server_t *except)
+{
+  for (uint8_t i=0; i<server_count; i++) {
+    if (servers[i].mode == SERVER_MODE_PEER && &servers[i] != except)
+      servers[i].dirty[slot / 8] |= (1 << (slot % 8));
+  }
+}
+
+// Apply a change of the shared array that comes from the peer with
+// node identifier origin.  The last writer wins: the change is only
+// applied if its version is more recent than ours or, for the same
+// version, if the value differs and the origin has a higher node_id.
+// Versions wrap, so they are compared on their difference.  Applied
+// changes are passed on to the other peers, the peer that sent it
+// being recognised by its server identifier, which should thus be
+// its node_id.  Returns true if the change was applied.
+boolean TinyREST::syncShared(uint8_t slot, uint8_t version, unsigned int value, uint8_t origin)
+{
+  int8_t diff;
+  
+  if (slot >= SHARED_LEN)
+    return false;
+  diff = (int8_t)(version - shared_version[slot]);
+  if (diff < 0)
+    return false;
+  if (diff == 0 && (shared[slot] == value || origin <= node_id))
+    return false;
+  
+  shared[slot] = value;
+  shared_version[slot] = version;
+  markShared(slot, findServer(origin));
+  return true;
+}
+#endif
@@ -1,11 +1,36 @@
-#include <WiServer.h>
-#include <WProgram.h>
-#include <EEPROM.h>
 #include <stdio.h>
 
 #include "TinyREST.h"
 
 #ifdef HAVE_SUBSCRIBE
+// Compute where to start looking for a (type, position) in the index of
+// watches.  WATCH_INDEX_LEN is a power of two.
+static uint8_t watchHash(int position, uint8_t type)
+{
+  return ((uint8_t)position * 7 + (uint8_t)(position >> 8) * 3 + type * 13)
+    & (WATCH_INDEX_LEN - 1);
+}
+
+// Find the entry of the index of watches that points at the first
+// watch for a given (type, position), the index is open-addressed with
+// linear probing.  Returns WATCH_NONE if there is no such watch.
+uint8_t TinyREST::findIndex(int position, uint8_t type)
+{
+  uint8_t h = watchHash(position, type);
+  
+  for (uint8_t i=0; i<WATCH_INDEX_LEN; i++) {
+    uint8_t slot = watch_index[h];
+    if (slot == WATCH_NONE)
+      return WATCH_NONE;
+    if (slot != WATCH_DELETED
+        && watchs[slot].type == type && watchs[slot].position == position)
+      return h;
+    h = (h + 1) & (WATCH_INDEX_LEN - 1);
+  }
+  
+  return WATCH_NONE;
+}
+
 // Add a value watch, i.e. arrange for a given value (see below)
 // to be watched with a given frequency (expressed in millisecs)
 // and to produce a callback every time the value has changed.
@@ -13,19 +38,60 @@
 // last one being a shared array that can be used for central
 // storage in distributed settings. Returns a pointers to the
 // structure that will keep the state of the watch, or NULL
-// on problems.
+// on problems.  Watches never move, the pointer remains valid
+// until the watch is removed, see watchHandle() for a safer way
+// to keep track of watches.  Several watches on the same value
+// share the same samples.
 vwatch_t *TinyREST::addWatch(int position, uint8_t type, unsigned long freq, ValueWatchCallback cb, void *blind)
 {
-  if (watch_count < MAX_WATCHS) {
-    watchs[watch_count].position = position;
-    watchs[watch_count].type = type;
-    watchs[watch_count].freq = freq;
-    watchs[watch_count].callback = cb;
-    watchs[watch_count].blind = blind;
-    getWatch(&watchs[watch_count], 0);
-    return &watchs[watch_count++];
+  uint8_t slot = watch_free;
+  uint8_t idx;
+  uint8_t entry = WATCH_NONE;
+  vwatch_t *w;
+  
+  if (slot == WATCH_NONE)
+    return NULL;
+  
+  // The watch will be chained after the existing watches for the same
+  // value, or be the first watch for that value in the index, in which
+  // case an entry is needed in the index.
+  idx = findIndex(position, type);
+  if (idx == WATCH_NONE) {
+    entry = watchHash(position, type);
+    for (idx=0; idx<WATCH_INDEX_LEN; idx++) {
+      if (watch_index[entry] == WATCH_NONE || watch_index[entry] == WATCH_DELETED)
+        break;
+      entry = (entry + 1) & (WATCH_INDEX_LEN - 1);
+    }
+    if (idx == WATCH_INDEX_LEN)
+      return NULL;
+    idx = WATCH_NONE;
   }
-  return NULL;
+  
+  w = &watchs[slot];
+  watch_free = w->next;
+  w->position = position;
+  w->type = type;
+  w->freq = freq;
+  w->freq_min = freq;
+  w->freq_max = 0;
+  w->callback = cb;
+  w->blind = blind;
+  w->lastChecked = 0;
+  w->next = WATCH_NONE;
+  
+  if (idx != WATCH_NONE) {
+    vwatch_t *last = &watchs[watch_index[idx]];
+    while (last->next != WATCH_NONE)
+      last = &watchs[last->next];
+    last->next = slot;
+  } else {
+    watch_index[entry] = slot;
+  }
+  
+  watch_count++;
+  getWatch(w, 0);
+  return w;
 }
 
 vwatch_t *TinyREST::addWatch(int position, uint8_t type, ValueWatchCallback cb, void *blind)
@@ -45,38 +111,107 @@ vwatch_t *TinyREST::addWatch(int position, uint8_t type, ValueWatchCallback cb)
 
 // Remove an existing watch, note that comparison is done on
 // pointers so you will probably have to call findWatch before
-// removing.
+// removing.  The slot of the watch gets a new generation, so that
+// handles to the removed watch become invalid.
 boolean TinyREST::removeWatch(vwatch_t *w) {
-  boolean found = false;
-  for (uint8_t i=0; i<watch_count; i++) {
-    if (&watchs[i] == w) {
-      found = true;
-      watch_count --;
-    }
-    if (found && (i<watch_count))
-      watchs[i] = watchs[i+1];
+  uint8_t slot;
+  uint8_t idx;
+  
+  if (w < watchs || w >= &watchs[MAX_WATCHS] || w->type == VALUE_WATCH_NONE)
+    return false;
+  slot = w - watchs;
+  
+  // Unchain the watch, replacing it in the index if it was first.
+  idx = findIndex(w->position, w->type);
+  if (idx == WATCH_NONE)
+    return false;
+  if (watch_index[idx] == slot) {
+    watch_index[idx] = (w->next == WATCH_NONE) ? WATCH_DELETED : w->next;
+  } else {
+    vwatch_t *prev = &watchs[watch_index[idx]];
+    while (prev->next != WATCH_NONE && prev->next != slot)
+      prev = &watchs[prev->next];
+    if (prev->next != slot)
+      return false;
+    prev->next = w->next;
   }
   
-  return found;
+  w->type = VALUE_WATCH_NONE;
+  w->gen++;
+  w->next = watch_free;
+  watch_free = slot;
+  watch_count--;
+  
+  return true;
 }
 
-// Find an existing watch.
+// Find an existing watch, the first one that was added for the value
+// if there are several.
 vwatch_t *TinyREST::findWatch(int position, uint8_t type) {
-  for (uint8_t i=0; i<watch_count; i++) {
-    if (watchs[i].type == type && watchs[i].position == position) {
-      return &watchs[i];
-    }
-  }
+  uint8_t idx = findIndex(position, type);
+  
+  if (idx == WATCH_NONE)
+    return NULL;
+  return &watchs[watch_index[idx]];
+}
+
+// Return the next watch on the same value as a given watch, or NULL
+// if it was the last one.
+vwatch_t *TinyREST::nextWatch(vwatch_t *w) {
+  if (w->next == WATCH_NONE)
+    return NULL;
+  return &watchs[w->next];
+}
+
+// Return a handle to a watch: its slot together with the generation
+// of that slot.  Contrary to pointers, handles can be kept safely after
+// the watch has been removed, see lookupWatch().
+vwatch_handle_t TinyREST::watchHandle(vwatch_t *w) {
+  return ((vwatch_handle_t)w->gen << 8) | (uint8_t)(w - watchs);
+}
+
+// Return the watch behind a handle, or NULL if it has been removed
+// since the handle was taken.
+vwatch_t *TinyREST::lookupWatch(vwatch_handle_t h) {
+  uint8_t slot = h & 0xFF;
   
-  return NULL;
+  if (slot >= MAX_WATCHS)
+    return NULL;
+  if (watchs[slot].type == VALUE_WATCH_NONE || watchs[slot].gen != (h >> 8))
+    return NULL;
+  return &watchs[slot];
 }
 
 
+// Set the time between the samples of a watch, in millisecs.  The time
+// is adapted between min and max (see vwatch_t) when max is greater
+// than min, and fixed to min otherwise.
+void TinyREST::setFrequency(vwatch_t *w, unsigned long min, unsigned long max) {
+  w->freq = min;
+  w->freq_min = min;
+  w->freq_max = (max > min) ? max : 0;
+}
+
 // Actualise the value of a watch, depending on its type.  If the
 // time (now) is 0, the method will first get the current time
-// to mark at which time it was actualised.
+// to mark at which time it was actualised.  When another watch
+// on the same value was actualised at that same time, its value
+// is reused rather than sampled again.
 int TinyREST::getWatch(vwatch_t *w, unsigned long now) {
+  uint8_t idx;
+  
   if (now == 0) now = millis();
+  idx = findIndex(w->position, w->type);
+  if (idx != WATCH_NONE) {
+    for (uint8_t s = watch_index[idx]; s != WATCH_NONE; s = watchs[s].next) {
+      if (&watchs[s] != w && watchs[s].lastChecked == now) {
+        w->value = watchs[s].value;
+        w->lastChecked = now;
+        return w->value;
+      }
+    }
+  }
+  
   switch (w->type) {
     case VALUE_WATCH_DPIN:
       w->value = digitalRead(w->position);
@@ -87,40 +222,85 @@ int TinyREST::getWatch(vwatch_t *w, unsigned long now) {
       w->lastChecked = now;
       break;
     case VALUE_WATCH_EEPROM:
+#ifdef HAVE_EEPROM
+      w->value = readEEPROM(w->position);
+#else
       w->value = EEPROM.read(w->position);
+#endif
       w->lastChecked = now;
       break;
+#ifdef HAVE_SHARED
     case VALUE_WATCH_SHARED:
       w->value = this->shared[w->position];
       w->lastChecked = now;
       break;
+#endif
   }
   return w->value;
 }
 
+// Return true if it is time to actualise a watch that is in use.
+boolean TinyREST::watchDue(vwatch_t *w, unsigned long now)
+{
+  return w->type != VALUE_WATCH_NONE && w->lastChecked + w->freq < now;
+}
+
 // Test a watch, i.e. test if it is time to actualise, 
 // actualise if it was so and, in relevant cases, perform
 // the callback.  The current time is supposed to be passed
-// as an argument.
+// as an argument.  The time until the next sample of adaptive
+// watches is shortened on changes, and lengthened otherwise.
 boolean TinyREST::testWatch(vwatch_t *w, unsigned long now)
 {
   // Don't do anything if it's not time yet...
-  if (w->lastChecked + w->freq < now) {
+  if (watchDue(w, now)) {
     // remember old value and actualise the watch.
     int oldval = w->value;
+#ifdef TINY_REST_DEBUG
     Serial.println("testing: ");
+#endif
     getWatch(w, now);
-    // If it has changed, perform the callback if we have one.
-    if (w->value != oldval && w->callback) {
+    // If it has changed, run the rules and perform the callback if
+    // we have one.
+    if (w->value != oldval) {
+#ifdef TINY_REST_DEBUG
       Serial.println("CHANGED");
-      w->callback(this, w->position, w->value, w->type, w->blind);
+#endif
+#ifdef HAVE_RULES
+      runRules(w);
+#endif
+      if (w->freq_max)
+        w->freq = w->freq_min;
+      if (w->callback)
+        w->callback(this, w->position, w->value, w->type, w->blind);
       return true;
     }
+    if (w->freq < w->freq_max) {
+      w->freq = w->freq * 2 + 1;
+      if (w->freq > w->freq_max)
+        w->freq = w->freq_max;
+    }
   }
   
   return false;
 }
 
+// Remember the current value of a watch in the log of changes, under
+// a new sequence number.  The log is a ring, the oldest changes are
+// overwritten.
+void TinyREST::logChange(vwatch_t *w)
+{
+  vchange_t *c;
+  
+  change_seq++;
+  if (change_seq == 0) change_seq++;  // 0 is "no change seen"
+  c = &changes[change_seq % CHANGE_LOG_LEN];
+  c->seq = change_seq;
+  c->position = w->position;
+  c->value = w->value;
+  c->type = w->type;
+}
+
 // Test a watch after having asked the system for the current
 // time.
 boolean TinyREST::testWatch(vwatch_t *w)
@@ -0,0 +1,227 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "TinyRESTPosix.h"
+
+// Time since the first call, so that it starts from 0 as on a board.
+static struct timespec started;
+static boolean simulated = false;
+static unsigned long long simulated_us = 0;
+
+static unsigned long long elapsed_us() {
+  struct timespec now;
+
+  if (simulated)
+    return simulated_us;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (started.tv_sec == 0 && started.tv_nsec == 0)
+    started = now;
+  return (unsigned long long)(now.tv_sec - started.tv_sec) * 1000000ULL
+    + (now.tv_nsec - started.tv_nsec) / 1000;
+}
+
+unsigned long millis() {
+  return (unsigned long)(elapsed_us() / 1000);
+}
+
+unsigned long micros() {
+  return (unsigned long)elapsed_us();
+}
+
+void rest_posix_advance(unsigned long us) {
+  if (!simulated) {
+    simulated_us = elapsed_us();
+    simulated = true;
+  }
+  simulated_us += us;
+}
+
+// The I/O ports of the virtual board, indexed by port number.  The
+// input register holds the levels given to rest_posix_input(), for the
+// pins in the driven register.
+static volatile uint8_t port_out[NUM_PORTS + 1];
+static volatile uint8_t port_mode[NUM_PORTS + 1];
+static uint8_t port_in[NUM_PORTS + 1];
+static uint8_t port_driven[NUM_PORTS + 1];
+static int analog[6];
+volatile uint8_t SREG;
+
+uint8_t digitalPinToPort(uint8_t pin) {
+  if (pin < 8)
+    return PD;
+  if (pin < 14)
+    return PB;
+  if (pin < NUM_DIGITAL_PINS)
+    return PC;
+  return NOT_A_PORT;
+}
+
+uint8_t digitalPinToBitMask(uint8_t pin) {
+  if (pin < 8)
+    return 1 << pin;
+  if (pin < 14)
+    return 1 << (pin - 8);
+  if (pin < NUM_DIGITAL_PINS)
+    return 1 << (pin - 14);
+  return 0;
+}
+
+volatile uint8_t *portOutputRegister(uint8_t port) {
+  return (port == NOT_A_PORT || port > NUM_PORTS) ? NULL : &port_out[port];
+}
+
+volatile uint8_t *portModeRegister(uint8_t port) {
+  return (port == NOT_A_PORT || port > NUM_PORTS) ? NULL : &port_mode[port];
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  uint8_t port = digitalPinToPort(pin);
+
+  if (port == NOT_A_PORT)
+    return;
+  if (mode == OUTPUT)
+    port_mode[port] |= digitalPinToBitMask(pin);
+  else
+    port_mode[port] &= ~digitalPinToBitMask(pin);
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  uint8_t port = digitalPinToPort(pin);
+
+  if (port == NOT_A_PORT)
+    return;
+  if (value == LOW)
+    port_out[port] &= ~digitalPinToBitMask(pin);
+  else
+    port_out[port] |= digitalPinToBitMask(pin);
+}
+
+int digitalRead(uint8_t pin) {
+  uint8_t port = digitalPinToPort(pin);
+  uint8_t mask = digitalPinToBitMask(pin);
+
+  if (port == NOT_A_PORT)
+    return LOW;
+  if (port_driven[port] & mask & ~port_mode[port])
+    return (port_in[port] & mask) ? HIGH : LOW;
+  // Outputs, and inputs which pull-up is on or off.
+  return (port_out[port] & mask) ? HIGH : LOW;
+}
+
+void rest_posix_input(uint8_t pin, uint8_t level) {
+  uint8_t port = digitalPinToPort(pin);
+
+  if (port == NOT_A_PORT)
+    return;
+  port_driven[port] |= digitalPinToBitMask(pin);
+  if (level == LOW)
+    port_in[port] &= ~digitalPinToBitMask(pin);
+  else
+    port_in[port] |= digitalPinToBitMask(pin);
+}
+
+int analogRead(uint8_t pin) {
+  if (pin >= 14)
+    pin -= 14;
+  return (pin < 6) ? analog[pin] : 0;
+}
+
+void rest_posix_analog(uint8_t pin, int value) {
+  if (pin >= 14)
+    pin -= 14;
+  if (pin < 6)
+    analog[pin] = value;
+}
+
+// There is no PWM, the pin is set to the level its duty cycle is the
+// closest to.
+void analogWrite(uint8_t pin, int value) {
+  pinMode(pin, OUTPUT);
+  digitalWrite(pin, (value >= 128) ? HIGH : LOW);
+}
+
+// The EEPROM is erased (all 0xFF) until it is loaded from a file, and
+// every write goes through to the file from there on.
+static uint8_t eeprom[E2END + 1];
+static boolean eeprom_erased = false;
+static int eeprom_fd = -1;
+EEPROMClass EEPROM;
+
+static void eeprom_erase() {
+  if (!eeprom_erased) {
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    eeprom_erased = true;
+  }
+}
+
+boolean rest_posix_eeprom(const char *path) {
+  ssize_t len;
+
+  eeprom_erase();
+  eeprom_fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (eeprom_fd < 0)
+    return false;
+  len = pread(eeprom_fd, eeprom, sizeof(eeprom), 0);
+  if (len < 0)
+    len = 0;
+  if (len < (ssize_t)sizeof(eeprom)) {
+    memset(&eeprom[len], 0xFF, sizeof(eeprom) - len);
+    if (pwrite(eeprom_fd, eeprom, sizeof(eeprom), 0) != sizeof(eeprom)) {
+      close(eeprom_fd);
+      eeprom_fd = -1;
+      return false;
+    }
+  }
+  return true;
+}
+
+uint8_t EEPROMClass::read(int address) {
+  eeprom_erase();
+  if (address < 0 || address > E2END)
+    return 0xFF;
+  return eeprom[address];
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+  eeprom_erase();
+  if (address < 0 || address > E2END)
+    return;
+  eeprom[address] = value;
+  if (eeprom_fd >= 0 && pwrite(eeprom_fd, &value, 1, address) != 1)
+    perror("EEPROM");
+}
+
+size_t rest_posix_strlcpy(char *dst, const char *src, size_t size) {
+  size_t len = strlen(src);
+
+  if (size > 0) {
+    size_t n = (len < size - 1) ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+  }
+  return len;
+}
+
+RestPosixSerial Serial;
+
+void RestPosixSerial::print(const char *s) {
+  fputs(s, stderr);
+}
+
+void RestPosixSerial::print(char c) {
+  fputc(c, stderr);
+}
+
+void RestPosixSerial::print(int i) {
+  fprintf(stderr, "%d", i);
+}
+
+void RestPosixSerial::println(const char *s) {
+  fprintf(stderr, "%s\n", s);
+}
+
+void RestPosixSerial::println(int i) {
+  fprintf(stderr, "%d\n", i);
+}
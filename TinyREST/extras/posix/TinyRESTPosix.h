@@ -0,0 +1,99 @@
+// Platform for running TinyREST on Linux, see TINY_REST_PLATFORM in
+// TinyREST.h.  It provides the part of the Arduino core that the
+// library uses, for a virtual ATmega328 board: the pins and the I/O
+// ports only live in memory, and so does the EEPROM, unless it is kept
+// in a file given to rest_posix_eeprom().
+//
+// Digital pins 0 to 7 are on port D, 8 to 13 on port B and 14 to 19
+// (A0 to A5) on port C, as on the Arduino boards.  digitalRead() of an
+// input pin returns the level given to rest_posix_input(), and that of
+// other pins what was written to them (i.e. the pull-up for an input).
+// analogRead() returns the values given to rest_posix_analog(), 0 until
+// then.
+
+#ifndef TinyRESTPosix_h
+#define TinyRESTPosix_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH    (1)
+#define LOW     (0)
+#define INPUT   (0)
+#define OUTPUT  (1)
+
+unsigned long millis();
+unsigned long micros();
+
+// Move the clock on by the given microseconds.  From the first call on,
+// the clock only moves through this, e.g. to simulate days of uptime.
+void rest_posix_advance(unsigned long us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+
+// Port tables, as in pins_arduino.h.  Ports are numbered from 1 for A.
+#define NUM_DIGITAL_PINS  (20)
+#define NUM_PORTS         (4)
+#define NOT_A_PORT        (0)
+#define PB                (2)
+#define PC                (3)
+#define PD                (4)
+uint8_t digitalPinToPort(uint8_t pin);
+uint8_t digitalPinToBitMask(uint8_t pin);
+volatile uint8_t *portOutputRegister(uint8_t port);
+volatile uint8_t *portModeRegister(uint8_t port);
+
+// There are no interrupts to turn off.
+extern volatile uint8_t SREG;
+#define cli()
+
+// EEPROM, as in EEPROM.h and avr/eeprom.h.
+#define E2END             (1023)
+class EEPROMClass {
+public:
+  uint8_t read(int address);
+  void write(int address, uint8_t value);
+};
+extern EEPROMClass EEPROM;
+#define eeprom_is_ready() (true)
+
+// Keep the EEPROM in path, which is created (erased) when missing.
+// Returns false when the file cannot be opened.
+boolean rest_posix_eeprom(const char *path);
+
+// Set the level of a digital pin, as read while it is an input.
+void rest_posix_input(uint8_t pin, uint8_t level);
+// Set the value (0 to 1023) of an analogue pin, 0 to 5 or 14 to 19.
+void rest_posix_analog(uint8_t pin, int value);
+
+// There is no program memory, constants stay in RAM.
+#define PROGMEM
+#define PSTR(s)           (s)
+#define pgm_read_byte(p)  (*(const uint8_t *)(p))
+#define strcasecmp_P      strcasecmp
+
+// Not in all versions of the C library, hence the different name.
+size_t rest_posix_strlcpy(char *dst, const char *src, size_t size);
+#define strlcpy           rest_posix_strlcpy
+
+// Debugging output, on the standard error.
+class RestPosixSerial {
+public:
+  void print(const char *s);
+  void print(char c);
+  void print(int i);
+  void println(const char *s);
+  void println(int i);
+};
+extern RestPosixSerial Serial;
+
+#endif
@@ -0,0 +1,520 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "TinyRESTPosix.h"
+#include "TinyRESTSocket.h"
+
+#define BUF_KEEP   (16384)    // Larger buffers are freed once sent.
+#define EVENTS     (64)       // Events handled per epoll_wait().
+
+RestSocketOut RestOut;
+struct rest_conn *rest_socket_conn = NULL;
+uint8_t rest_socket_addr[4];
+
+static int epoll_fd = -1;
+static int listen_fd = -1;
+static rest_page_func page_func = NULL;
+static struct rest_conn conns[REST_SOCKET_CONNS];
+static struct rest_conn *free_conns[REST_SOCKET_CONNS];
+static int free_count = 0;
+static RestGetRequest *requests = NULL;     // Active callback requests.
+static struct rest_buf *out_target = NULL;  // Where RestOut prints.
+static struct rest_buf text;                // Response being generated.
+static struct rest_buf post_text;           // POST body being generated.
+static unsigned long last_sweep = 0;
+
+static void buf_put(struct rest_buf *b, const char *s, size_t len) {
+  if (b->failed)
+    return;
+  if (b->len + len > b->size) {
+    size_t size = (b->size > 0) ? b->size : 256;
+    char *data;
+
+    while (size < b->len + len)
+      size *= 2;
+    data = (char *)realloc(b->data, size);
+    if (data == NULL) {
+      b->failed = true;
+      return;
+    }
+    b->data = data;
+    b->size = size;
+  }
+  memcpy(&b->data[b->len], s, len);
+  b->len += len;
+}
+
+static void buf_puts(struct rest_buf *b, const char *s) {
+  buf_put(b, s, strlen(s));
+}
+
+// Empty a buffer, keeping its memory unless it grew large.
+static void buf_reset(struct rest_buf *b) {
+  if (b->size > BUF_KEEP) {
+    free(b->data);
+    b->data = NULL;
+    b->size = 0;
+  }
+  b->len = 0;
+  b->sent = 0;
+  b->failed = false;
+}
+
+// Send what is left of a buffer, as much as the socket takes.  Returns
+// false when the connection failed.
+static boolean buf_send(int fd, struct rest_buf *b) {
+  while (b->sent < b->len) {
+    ssize_t n = send(fd, &b->data[b->sent], b->len - b->sent, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+    b->sent += n;
+  }
+  buf_reset(b);
+  return true;
+}
+
+void RestSocketOut::print(const char *s) {
+  if (out_target != NULL)
+    buf_puts(out_target, s);
+}
+
+void RestSocketOut::print(char c) {
+  if (out_target != NULL)
+    buf_put(out_target, &c, 1);
+}
+
+void RestSocketOut::println(const char *s) {
+  print(s);
+  print('\n');
+}
+
+void RestSocketOut::println(char c) {
+  print(c);
+  print('\n');
+}
+
+void RestSocketOut::println() {
+  print('\n');
+}
+
+/*
+ * Server side
+ */
+
+static void conn_close(struct rest_conn *c) {
+  close(c->fd);
+  c->fd = -1;
+  c->in_len = 0;
+  buf_reset(&c->out);
+  c->sending = false;
+  c->closing = false;
+  free_conns[free_count++] = c;
+}
+
+// Wait for the socket to take the responses, or for more requests,
+// not both, so that a client that does not read its responses does not
+// make us keep more and more of them.
+static void conn_wait(struct rest_conn *c, boolean sending) {
+  struct epoll_event ev;
+
+  if (c->sending == sending)
+    return;
+  ev.events = sending ? EPOLLOUT : EPOLLIN;
+  ev.data.ptr = c;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+  c->sending = sending;
+}
+
+// Send the responses of a connection, and close it when they have been
+// sent and it is closing.
+static void conn_flush(struct rest_conn *c) {
+  if (c->out.failed || !buf_send(c->fd, &c->out)) {
+    conn_close(c);
+  } else if (c->out.len > 0) {
+    conn_wait(c, true);
+  } else if (c->closing) {
+    conn_close(c);
+  } else {
+    conn_wait(c, false);
+  }
+}
+
+static void conn_error(struct rest_conn *c, const char *status) {
+  buf_puts(&c->out, "HTTP/1.1 ");
+  buf_puts(&c->out, status);
+  buf_puts(&c->out, "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+  c->closing = true;
+}
+
+// Answer a GET request for a path with what the page function prints.
+static void conn_respond(struct rest_conn *c, char *path, boolean keep) {
+  char head[128];
+  boolean found;
+
+  buf_reset(&text);
+  rest_socket_conn = c;
+  out_target = &text;
+  found = page_func(path);
+  out_target = NULL;
+  rest_socket_conn = NULL;
+
+  if (text.failed) {
+    conn_error(c, "500 Internal Server Error");
+    return;
+  }
+  sprintf(head, "HTTP/1.1 %s\r\nContent-Type: application/json\r\n"
+          "Content-Length: %lu\r\n%s\r\n", found ? "200 OK" : "404 Not Found",
+          (unsigned long)text.len, keep ? "" : "Connection: close\r\n");
+  buf_puts(&c->out, head);
+  buf_put(&c->out, text.data, text.len);
+  if (!keep)
+    c->closing = true;
+}
+
+// Return true when the header of the given name, in the head of a
+// request, has the given value.
+static boolean has_header(char *head, const char *name, const char *value) {
+  size_t len = strlen(name);
+
+  for (char *line = strstr(head, "\r\n"); line != NULL;
+       line = strstr(line + 2, "\r\n")) {
+    if (strncasecmp(line + 2, name, len) == 0 && line[2 + len] == ':') {
+      char *v = line + 3 + len;
+      while (*v == ' ' || *v == '\t')
+        v++;
+      return strncasecmp(v, value, strlen(value)) == 0;
+    }
+  }
+  return false;
+}
+
+// Handle all the complete requests received on a connection.
+static void conn_requests(struct rest_conn *c) {
+  while (!c->closing) {
+    char *end, *path, *version;
+    boolean keep;
+    size_t len;
+
+    c->in[c->in_len] = '\0';
+    end = strstr(c->in, "\r\n\r\n");
+    if (end == NULL)
+      return;
+    end[2] = '\0';
+    len = end + 4 - c->in;
+
+    // Request line: GET <path> HTTP/1.<n>
+    path = strchr(c->in, ' ');
+    version = (path != NULL) ? strchr(path + 1, ' ') : NULL;
+    if (version == NULL || strncmp(version + 1, "HTTP/1.", 7) != 0) {
+      conn_error(c, "400 Bad Request");
+      return;
+    }
+    if (path - c->in != 3 || strncmp(c->in, "GET", 3) != 0) {
+      conn_error(c, "405 Method Not Allowed");
+      return;
+    }
+    *path++ = '\0';
+    *version++ = '\0';
+    if (version[7] == '0')
+      keep = has_header(version, "Connection", "keep-alive");
+    else
+      keep = !has_header(version, "Connection", "close");
+    conn_respond(c, path, keep);
+
+    c->in_len -= len;
+    memmove(c->in, &c->in[len], c->in_len);
+  }
+}
+
+static void conn_read(struct rest_conn *c) {
+  while (!c->closing) {
+    ssize_t n;
+
+    if (c->in_len == REST_SOCKET_HEAD) {
+      conn_error(c, "431 Request Header Fields Too Large");
+      break;
+    }
+    n = recv(c->fd, &c->in[c->in_len], REST_SOCKET_HEAD - c->in_len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0) {
+      conn_close(c);
+      return;
+    }
+    c->in_len += n;
+    c->last = millis();
+    conn_requests(c);
+  }
+  conn_flush(c);
+}
+
+static void conn_accept() {
+  for (;;) {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    struct epoll_event ev;
+    struct rest_conn *c;
+    int one = 1;
+    int fd = accept4(listen_fd, (struct sockaddr *)&sa, &len,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return;
+    }
+    if (free_count == 0) {
+      close(fd);
+      continue;
+    }
+    c = free_conns[--free_count];
+    c->fd = fd;
+    memcpy(c->peer, &sa.sin_addr.s_addr, 4);
+    c->in_len = 0;
+    c->sending = false;
+    c->closing = false;
+    c->last = millis();
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      conn_close(c);
+  }
+}
+
+boolean rest_socket_begin(const char *addr, uint16_t port,
+                          rest_page_func page) {
+  struct sockaddr_in sa;
+  struct epoll_event ev;
+  int one = 1;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (addr != NULL && inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+    errno = EINVAL;
+    return false;
+  }
+  memcpy(rest_socket_addr, &sa.sin_addr.s_addr, 4);
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+    return false;
+  listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0)
+    return false;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0
+      || listen(listen_fd, SOMAXCONN) < 0)
+    return false;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &listen_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+    return false;
+
+  for (int i=REST_SOCKET_CONNS-1; i>=0; i--) {
+    conns[i].fd = -1;
+    free_conns[free_count++] = &conns[i];
+  }
+  page_func = page;
+  return true;
+}
+
+/*
+ * Client side
+ */
+
+RestGetRequest::RestGetRequest(uint8_t *ip, uint16_t port,
+                               const char *hostName, const char *URL) {
+  memcpy(this->ipAddr, ip, 4);
+  this->port = port;
+  this->hostName = hostName;
+  this->URL = URL;
+  this->returnFunc = NULL;
+  this->body = NULL;
+  this->active = false;
+  this->fd = -1;
+  this->submitted = 0;
+  memset(&this->out, 0, sizeof(this->out));
+  this->next = NULL;
+}
+
+RestPostRequest::RestPostRequest(uint8_t *ip, uint16_t port,
+                                 const char *hostName, const char *URL,
+                                 rest_body_func body)
+  : RestGetRequest(ip, port, hostName, URL) {
+  this->body = body;
+}
+
+// Send the request, as HTTP/1.0 so that the end of the response is the
+// end of the connection.  Requests that cannot be sent are only ended
+// by the next rest_socket_task(), as WiServer would.
+void RestGetRequest::submit() {
+  struct rest_buf *target = out_target;
+  struct sockaddr_in sa;
+  struct epoll_event ev;
+
+  if (active)
+    return;
+  active = true;
+  submitted = millis();
+  next = requests;
+  requests = this;
+
+  buf_reset(&out);
+  buf_puts(&out, (body != NULL) ? "POST " : "GET ");
+  buf_puts(&out, URL);
+  buf_puts(&out, " HTTP/1.0\r\nHost: ");
+  buf_puts(&out, hostName);
+  if (body != NULL) {
+    char head[96];
+
+    buf_reset(&post_text);
+    out_target = &post_text;
+    body();
+    out_target = target;
+    sprintf(head, "\r\nContent-Type: application/x-www-form-urlencoded"
+            "\r\nContent-Length: %lu", (unsigned long)post_text.len);
+    buf_puts(&out, head);
+    buf_puts(&out, "\r\n\r\n");
+    buf_put(&out, post_text.data, post_text.len);
+    if (post_text.failed)
+      out.failed = true;
+  } else {
+    buf_puts(&out, "\r\n\r\n");
+  }
+  if (out.failed)
+    return;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  memcpy(&sa.sin_addr.s_addr, ipAddr, 4);
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return;
+  ev.events = EPOLLOUT;
+  ev.data.ptr = this;
+  if ((connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0
+       && errno != EINPROGRESS)
+      || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+// End a request, successful or not, and tell its return function.
+static void request_end(RestGetRequest *r) {
+  RestGetRequest **p = &requests;
+
+  while (*p != NULL && *p != r)
+    p = &(*p)->next;
+  if (*p != NULL)
+    *p = r->next;
+  if (r->fd >= 0)
+    close(r->fd);
+  r->fd = -1;
+  buf_reset(&r->out);
+  r->active = false;
+  if (r->returnFunc != NULL)
+    r->returnFunc(NULL, 0);
+}
+
+static void request_event(RestGetRequest *r, uint32_t events) {
+  if (r->out.len > 0) {
+    // Connecting, or sending the request.
+    struct epoll_event ev;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0
+        || !buf_send(r->fd, &r->out)) {
+      request_end(r);
+    } else if (r->out.len == 0) {
+      ev.events = EPOLLIN;
+      ev.data.ptr = r;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, r->fd, &ev);
+    }
+    return;
+  }
+
+  // Receiving the response.
+  for (;;) {
+    char data[512];
+    ssize_t n = recv(r->fd, data, sizeof(data), 0);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (n <= 0) {
+      request_end(r);
+      return;
+    }
+    if (r->returnFunc != NULL)
+      r->returnFunc(data, n);
+  }
+}
+
+/*
+ * Event loop
+ */
+
+// Close the connections that have been idle for too long, and end the
+// requests that could not be sent or that have timed out.
+static void sweep(unsigned long now, boolean timers) {
+  RestGetRequest *r = requests;
+
+  while (r != NULL) {
+    RestGetRequest *next = r->next;
+    if (r->fd < 0 || (timers && now - r->submitted >= REST_SOCKET_TIMEOUT))
+      request_end(r);
+    r = next;
+  }
+  if (timers) {
+    for (int i=0; i<REST_SOCKET_CONNS; i++) {
+      if (conns[i].fd >= 0 && now - conns[i].last >= REST_SOCKET_IDLE)
+        conn_close(&conns[i]);
+    }
+    last_sweep = now;
+  }
+}
+
+void rest_socket_task(int timeout) {
+  struct epoll_event events[EVENTS];
+  unsigned long now;
+  int n;
+
+  n = epoll_wait(epoll_fd, events, EVENTS, timeout);
+  for (int i=0; i<n; i++) {
+    void *p = events[i].data.ptr;
+
+    if (p == &listen_fd) {
+      conn_accept();
+    } else if ((char *)p >= (char *)conns
+               && (char *)p < (char *)&conns[REST_SOCKET_CONNS]) {
+      struct rest_conn *c = (struct rest_conn *)p;
+      if (events[i].events & EPOLLOUT) {
+        conn_flush(c);
+      } else {
+        conn_read(c);
+      }
+    } else {
+      request_event((RestGetRequest *)p, events[i].events);
+    }
+  }
+  now = millis();
+  sweep(now, now - last_sweep >= 1000);
+}
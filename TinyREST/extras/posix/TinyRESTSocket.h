@@ -0,0 +1,131 @@
+// Transport for running TinyREST on Linux, see TINY_REST_TRANSPORT in
+// TinyREST.h.  Requests are served by a non-blocking HTTP/1.1 server
+// (keep-alive and pipelining) and the callbacks are sent by a
+// non-blocking HTTP client, both driven by a single epoll loop:
+// rest_socket_task() waits for events and handles them, it is to be
+// called in a loop together with TinyREST::loop().  All of it runs in
+// the thread calling rest_socket_task(), as TinyREST is not thread
+// safe.  Up to REST_SOCKET_CONNS connections are served at once.
+//
+// Unlike WiServer, the whole response to a request is generated by a
+// single call to the page function, and kept until it is sent.  Thus
+// REST_NEW_REQUEST() is always true, and a connection never asks for
+// more of its response, which REST_CONNECTION_OPEN() tells the library.
+
+#ifndef TinyRESTSocket_h
+#define TinyRESTSocket_h
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef REST_SOCKET_CONNS
+#define REST_SOCKET_CONNS   (1024)    // Connections served at once
+#endif
+#ifndef REST_SOCKET_HEAD
+#define REST_SOCKET_HEAD    (1024)    // Longest request head
+#endif
+#define REST_SOCKET_IDLE    (30000)   // Idle connections closed (ms)
+#define REST_SOCKET_TIMEOUT (5000)    // Callbacks given up (ms)
+
+typedef void (*rest_return_func)(char *data, int len);
+typedef void (*rest_body_func)();
+typedef boolean (*rest_page_func)(char *URL);
+
+// Growing buffer of the data to send on a socket.
+struct rest_buf {
+  char *data;
+  size_t len;                     // Bytes in data.
+  size_t sent;                    // Bytes already sent.
+  size_t size;                    // Bytes allocated.
+  boolean failed;                 // An allocation failed.
+};
+
+// Where the responses, and the bodies of the POST requests, are printed.
+// Whatever is printed outside of these is lost.
+class RestSocketOut {
+public:
+  void print(const char *s);
+  void print(char c);
+  void println(const char *s);
+  void println(char c);
+  void println();
+  void print_P(const char *s) { print(s); }
+  void println_P(const char *s) { println(s); }
+};
+extern RestSocketOut RestOut;
+
+// A callback request, as GETrequest of WiServer.  The request is sent
+// by submit() and is active until the return function has been called
+// with NULL.
+class RestGetRequest {
+public:
+  RestGetRequest(uint8_t *ip, uint16_t port, const char *hostName,
+                 const char *URL);
+  void setReturnFunc(rest_return_func func) { returnFunc = func; }
+  void submit();
+  boolean isActive() { return active; }
+
+  uint8_t ipAddr[4];
+  uint16_t port;                  // Host order.
+  const char *hostName;
+  const char *URL;
+  rest_return_func returnFunc;
+
+  // Used by the transport only.
+  rest_body_func body;            // NULL for a GET request.
+  boolean active;
+  int fd;
+  unsigned long submitted;        // When, see REST_SOCKET_TIMEOUT.
+  struct rest_buf out;
+  RestGetRequest *next;           // In the list of active requests.
+};
+
+// A POST request, as POSTrequest of WiServer, the body function prints
+// the body to RestOut.
+class RestPostRequest : public RestGetRequest {
+public:
+  RestPostRequest(uint8_t *ip, uint16_t port, const char *hostName,
+                  const char *URL, rest_body_func body);
+};
+
+// A connection being served.
+struct rest_conn {
+  int fd;                         // -1 when the slot is free.
+  uint8_t peer[4];
+  char in[REST_SOCKET_HEAD + 1];  // Request being received.
+  size_t in_len;
+  struct rest_buf out;            // Responses being sent.
+  boolean sending;                // Waiting to send out, not reading.
+  boolean closing;                // Close once out is sent.
+  unsigned long last;             // Last activity, see REST_SOCKET_IDLE.
+};
+
+extern struct rest_conn *rest_socket_conn;   // Connection being handled.
+extern uint8_t rest_socket_addr[4];          // Address served on.
+
+// Serve page on the given IPv4 address (any when NULL) and port.  The
+// page function is called with the path of each GET request, as with
+// WiServer.init(), and its answer is sent with a 200 status when it
+// returns true, 404 otherwise.  Returns false, with errno set, when the
+// server could not be set up.
+boolean rest_socket_begin(const char *addr, uint16_t port,
+                          rest_page_func page);
+
+// Wait for events for up to timeout millisecs, and handle them.
+void rest_socket_task(int timeout);
+
+#define REST_OUT            RestOut
+#define REST_GET_REQUEST    RestGetRequest
+#define REST_POST_REQUEST   RestPostRequest
+#define REST_RETURN_FUNC    rest_return_func
+#define REST_SET_TARGET(r, ip, p) do { \
+    memcpy((r)->ipAddr, (ip), 4); \
+    (r)->port = (p); \
+  } while (0)
+#define REST_CLIENT_ADDR(a) memcpy((a), rest_socket_conn->peer, 4)
+#define REST_LOCAL_ADDR(a)  memcpy((a), rest_socket_addr, 4)
+#define REST_CONNECTION()   ((void *)rest_socket_conn)
+#define REST_NEW_REQUEST()  (true)
+#define REST_CONNECTION_OPEN(c) (false)
+
+#endif
@@ -0,0 +1,198 @@
+// HTTP load generator for benchmarking the gateway over the loopback
+// when no load tool (wrk, ab...) is at hand.  Each connection sends a
+// GET request with keep-alive, waits for the whole response and sends
+// the next one, for the given duration.  The number of requests per
+// second and the percentiles of their latency are printed at the end.
+//
+// usage: rest-bench [-c connections] [-d seconds] http://<ip>:<port><path>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CONNS    (4096)
+#define MAX_SAMPLES  (1 << 22)
+
+struct client {
+  int fd;
+  char in[4096];
+  size_t in_len;
+  unsigned long long sent;        // When the request was sent (ns).
+};
+
+static struct client clients[MAX_CONNS];
+static unsigned int *samples;     // Latencies (us).
+static unsigned long nsamples = 0;
+static unsigned long total = 0;  // Responses, including unsampled ones.
+static unsigned long errors = 0;
+static unsigned long statuses[6];  // Responses by status class.
+static struct sockaddr_in target;
+static char request[1024];
+static size_t request_len;
+static int epoll_fd;
+
+static unsigned long long now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void client_send(struct client *c) {
+  c->sent = now_ns();
+  if (send(c->fd, request, request_len, MSG_NOSIGNAL) != (ssize_t)request_len)
+    errors++;
+}
+
+static bool client_open(struct client *c) {
+  struct epoll_event ev;
+  int one = 1;
+
+  c->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (c->fd < 0)
+    return false;
+  if (connect(c->fd, (struct sockaddr *)&target, sizeof(target)) < 0) {
+    close(c->fd);
+    return false;
+  }
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  c->in_len = 0;
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+  client_send(c);
+  return true;
+}
+
+// Take the complete responses out of the input of a client, returns
+// false when the connection has to be opened again.
+static bool client_responses(struct client *c) {
+  for (;;) {
+    char *end, *length;
+    size_t head, len = 0;
+    int status;
+
+    c->in[c->in_len] = '\0';
+    end = strstr(c->in, "\r\n\r\n");
+    if (end == NULL)
+      return true;
+    head = end + 4 - c->in;
+    length = strcasestr(c->in, "\r\nContent-Length:");
+    if (length != NULL && length < end)
+      len = strtoul(length + 17, NULL, 10);
+    if (c->in_len < head + len)
+      return true;
+
+    if (nsamples < MAX_SAMPLES)
+      samples[nsamples++] = (now_ns() - c->sent) / 1000;
+    total++;
+    status = (c->in_len > 9) ? c->in[9] - '0' : 0;
+    statuses[(status >= 1 && status <= 5) ? status : 0]++;
+
+    if (strcasestr(c->in, "\r\nConnection: close") != NULL)
+      return false;
+    c->in_len -= head + len;
+    memmove(c->in, &c->in[head + len], c->in_len);
+    client_send(c);
+  }
+}
+
+static int compare(const void *a, const void *b) {
+  unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+  int conns = 64, seconds = 10, opt;
+  char host[64], *path;
+  unsigned int port = 80;
+  unsigned long long start, end;
+
+  while ((opt = getopt(argc, argv, "c:d:")) != -1) {
+    switch (opt) {
+      case 'c': conns = atoi(optarg); break;
+      case 'd': seconds = atoi(optarg); break;
+      default: optind = argc + 1;
+    }
+  }
+  if (optind != argc - 1 || conns < 1 || conns > MAX_CONNS
+      || strncmp(argv[optind], "http://", 7) != 0) {
+    fprintf(stderr, "usage: %s [-c connections] [-d seconds] "
+            "http://<ip>:<port><path>\n", argv[0]);
+    return 2;
+  }
+  path = strchr(argv[optind] + 7, '/');
+  snprintf(host, sizeof(host), "%.*s",
+           (int)((path ? path : argv[optind] + strlen(argv[optind]))
+                 - argv[optind] - 7), argv[optind] + 7);
+  if (strchr(host, ':') != NULL) {
+    port = atoi(strchr(host, ':') + 1);
+    *strchr(host, ':') = '\0';
+  }
+  memset(&target, 0, sizeof(target));
+  target.sin_family = AF_INET;
+  target.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &target.sin_addr) != 1) {
+    fprintf(stderr, "%s: not an IPv4 address\n", host);
+    return 2;
+  }
+  request_len = snprintf(request, sizeof(request),
+                         "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                         path ? path : "/", host);
+
+  samples = (unsigned int *)malloc(MAX_SAMPLES * sizeof(unsigned int));
+  if (samples == NULL)
+    return 1;
+  epoll_fd = epoll_create1(0);
+  for (int i=0; i<conns; i++) {
+    if (!client_open(&clients[i])) {
+      fprintf(stderr, "connect: %s\n", strerror(errno));
+      return 1;
+    }
+  }
+
+  start = now_ns();
+  end = start + seconds * 1000000000ULL;
+  while (now_ns() < end) {
+    struct epoll_event events[64];
+    int n = epoll_wait(epoll_fd, events, 64, 100);
+
+    for (int i=0; i<n; i++) {
+      struct client *c = (struct client *)events[i].data.ptr;
+      ssize_t len = recv(c->fd, &c->in[c->in_len],
+                         sizeof(c->in) - 1 - c->in_len, 0);
+      if (len > 0) {
+        c->in_len += len;
+        if (client_responses(c))
+          continue;
+      } else {
+        errors++;
+      }
+      close(c->fd);
+      if (!client_open(c))
+        errors++;
+    }
+  }
+  end = now_ns();
+
+  qsort(samples, nsamples, sizeof(unsigned int), compare);
+  printf("%lu requests in %.1fs over %d connections: %.0f requests/s\n",
+         total, (end - start) / 1e9, conns, total / ((end - start) / 1e9));
+  if (nsamples > 0)
+    printf("latency (us): p50 %u, p99 %u, max %u\n",
+           samples[nsamples / 2], samples[nsamples * 99 / 100],
+           samples[nsamples - 1]);
+  printf("responses: 2xx %lu, 4xx %lu, 5xx %lu, other %lu; errors %lu\n",
+         statuses[2], statuses[4], statuses[5],
+         statuses[0] + statuses[1] + statuses[3], errors);
+  return 0;
+}
@@ -0,0 +1,65 @@
+// TinyREST on a Linux gateway: the commands, watches and JSON answers
+// of a board, served over HTTP by TinyRESTSocket, for a virtual board
+// (see TinyRESTPosix.h).
+//
+// usage: tinyrest-gateway [-a address] [-p port] [-n node] [-e eeprom]
+//   -a  IPv4 address to serve on, all of them by default
+//   -p  port to serve on, 8080 by default
+//   -n  identifier of the gateway among its peers, see init(node_id)
+//   -e  file keeping the EEPROM, the EEPROM is lost on exit otherwise
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "TinyREST.h"
+
+TinyREST rest;
+
+static boolean servePage(char *URL) {
+  return rest.handleURL(URL);
+}
+
+int main(int argc, char **argv) {
+  const char *addr = NULL;
+  const char *eeprom = NULL;
+  int port = 8080;
+  int node = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "a:p:n:e:")) != -1) {
+    switch (opt) {
+      case 'a': addr = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 'n': node = atoi(optarg); break;
+      case 'e': eeprom = optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [-a address] [-p port] [-n node] "
+                "[-e eeprom]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  if (eeprom != NULL && !rest_posix_eeprom(eeprom)) {
+    fprintf(stderr, "%s: %s\n", eeprom, strerror(errno));
+    return 1;
+  }
+  if (!rest_socket_begin(addr, port, servePage)) {
+    fprintf(stderr, "port %d: %s\n", port, strerror(errno));
+    return 1;
+  }
+#ifdef HAVE_FEDERATION
+  rest.init(node);
+#else
+  (void)node;
+  rest.init();
+#endif
+
+  for (;;) {
+    rest_socket_task(1);
+    rest.loop();
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+// Transport for soaking TinyREST on the host, see TINY_REST_TRANSPORT
+// in TinyREST.h and soak.cpp.  There is no network: the soak driver
+// plays WiServer and the callback servers.
+//
+// As with WiServer, the page function is called once when a request
+// arrives (REST_NEW_REQUEST() true) and again for each segment of the
+// response and each retransmission, the whole response being generated
+// on every call.  Several connections can be part way through their
+// responses at once.  Callback requests are answered, or fail, after a
+// delay decided by the driver for each server.
+
+#ifndef TinyRESTSoak_h
+#define TinyRESTSoak_h
+
+#include <stdint.h>
+#include <string.h>
+
+#define SOAK_OUT_LEN  (8192)      // Longest response kept
+
+typedef void (*soak_return_func)(char *data, int len);
+typedef void (*soak_body_func)();
+
+// Where the responses, and the bodies of the POST requests, are printed.
+class SoakOut {
+public:
+  void print(const char *s);
+  void print(char c);
+  void println(const char *s);
+  void println(char c);
+  void println();
+  void print_P(const char *s) { print(s); }
+  void println_P(const char *s) { println(s); }
+
+  char data[SOAK_OUT_LEN + 1];
+  unsigned int len;
+  boolean overflow;               // Some of the output was lost.
+  void reset() { len = 0; overflow = false; data[0] = '\0'; }
+};
+extern SoakOut SoakOutput;
+
+// A callback request, as GETrequest of WiServer.
+class SoakGetRequest {
+public:
+  SoakGetRequest(uint8_t *ip, uint16_t port, const char *hostName,
+                 const char *URL);
+  void setReturnFunc(soak_return_func func) { returnFunc = func; }
+  void submit();
+  boolean isActive() { return active; }
+
+  uint8_t ipAddr[4];
+  uint16_t port;
+  const char *hostName;
+  const char *URL;
+  soak_return_func returnFunc;
+
+  // Used by the driver only.
+  soak_body_func body;            // NULL for a GET request.
+  boolean active;
+  unsigned long due;              // When it ends (millis()).
+  boolean ok;                     // Whether it ends with a 2xx answer.
+};
+
+// A POST request, as POSTrequest of WiServer.
+class SoakPostRequest : public SoakGetRequest {
+public:
+  SoakPostRequest(uint8_t *ip, uint16_t port, const char *hostName,
+                  const char *URL, soak_body_func body);
+};
+
+// A connection of a client of the board.
+struct soak_conn {
+  uint8_t ip[4];
+  boolean open;                   // Still asking for its response.
+};
+
+extern struct soak_conn *soak_current;      // Connection being handled.
+extern boolean soak_new;                    // Request has just arrived.
+
+// Called by submit(), decides when and how the request ends.
+void soak_submitted(SoakGetRequest *r);
+
+#define REST_OUT            SoakOutput
+#define REST_GET_REQUEST    SoakGetRequest
+#define REST_POST_REQUEST   SoakPostRequest
+#define REST_RETURN_FUNC    soak_return_func
+#define REST_SET_TARGET(r, ip, p) do { \
+    memcpy((r)->ipAddr, (ip), 4); \
+    (r)->port = (p); \
+  } while (0)
+#define REST_CLIENT_ADDR(a) memcpy((a), soak_current->ip, 4)
+#define REST_LOCAL_ADDR(a)  do { \
+    (a)[0] = 10; (a)[1] = 0; (a)[2] = 0; (a)[3] = 1; \
+  } while (0)
+#define REST_CONNECTION()   ((void *)soak_current)
+#define REST_NEW_REQUEST()  (soak_new)
+#define REST_CONNECTION_OPEN(c) (((struct soak_conn *)(c))->open)
+// Same pins as the WiShield.
+#define REST_RESERVED_PIN(pin) ((pin) == 2 || ((pin) >= 10 && (pin) <= 13))
+
+#endif
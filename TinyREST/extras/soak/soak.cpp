@@ -0,0 +1,819 @@
+// Soak test of TinyREST on the host: the real library, on the virtual
+// board of extras/posix with a simulated clock, driven through the
+// transport of TinyRESTSoak.h for simulated days of uptime.
+//
+// Every tick (10 ms of simulated time) the driver moves the pins along
+// their waveforms, sends the next request of the trace when it is due,
+// makes each open connection ask for the next segment of its response,
+// ends the callback requests that are due, and calls loop().  At the end
+// it reports:
+//   - the handling time (host time) of handleURL() and loop(), p50, p99
+//     and max;
+//   - the responses: busy, refused for lack of a connection, and
+//     inconsistent, i.e. different from one segment to the next while
+//     no subscribe or unsubscribe was answered meanwhile (those still
+//     change the status being sent, see respond_status());
+//   - the callbacks: values delivered to each server, failed, dropped,
+//     and subscriptions which server did not get the last value;
+//   - every simulated hour, the heap: the allocations of the library go
+//     through a model of the allocator of avr-libc on a heap of its own,
+//     so that its fragmentation is measured as it would build up on a
+//     board (with the block sizes of the host).
+//
+// usage: soak [-d hours] [-r requests/s] [-l latency] [-m mode] [-H heap]
+//             [-s seed] [-t trace] [-e eeprom] [-b]
+//   -d  simulated hours, 24 by default
+//   -r  requests per simulated second of the synthetic trace, 2 by
+//       default
+//   -l  time (ms) that the callback servers take to answer, 50 by default
+//   -m  mode of the callback servers, see server_add, 0 by default
+//   -H  size of the heap, 2048 bytes by default
+//   -s  seed of the synthetic trace and of the failures
+//   -t  trace to replay instead of the synthetic one: one request per
+//       line, "<delay in ms> <path>"
+//   -e  file keeping the EEPROM
+//   -b  boot only: measure init(), with what it restored from the
+//       EEPROM (see TINYREST_PERSIST), and exit
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "TinyREST.h"
+
+#define TICK          (10)        // Simulated time per tick (ms)
+#define CONNS         (4)         // Connections, as UIP_CONNS
+#define SEGMENT       (128)       // Bytes per segment of a response
+#define SERVERS       (4)         // Callback servers of the soak
+#define DEAD_SERVER   (4)         // Server that never answers
+#define SERVER_PORT   (8000)      // Port of server n is SERVER_PORT + n
+#define SETTLE        (600000)    // Time given to callbacks at the end
+
+TinyREST rest;
+
+/*
+ * Heap model
+ */
+
+// Model of the allocator of avr-libc: free blocks are kept in a list
+// sorted by address, an allocation takes the block that fits exactly or
+// else the smallest one that is larger (split from its top), and only
+// extends the heap when none is.  Blocks given back are merged with
+// their neighbours, and given back to the heap when at its top.  Blocks
+// have a header of one size_t and are rounded to its size, for the
+// alignment that the host needs.
+#define HEAP_MAX      (65536)
+#define HEAP_HEADER   (sizeof(size_t))
+#define SIZE_CLASSES  (64)
+
+struct heap_block {
+  size_t size;                    // Size of the block, less its header.
+  struct heap_block *next;        // Next free block.
+};
+
+static unsigned char heap[HEAP_MAX] __attribute__((aligned(16)));
+static size_t heap_size = 2048;
+static size_t heap_top = 0;       // Bytes of the heap handed out so far.
+static struct heap_block *heap_free = NULL;
+static unsigned long heap_allocs = 0, heap_frees = 0, heap_failed = 0;
+static unsigned long heap_live = 0;
+static unsigned long class_allocs[SIZE_CLASSES], class_live[SIZE_CLASSES];
+
+extern "C" void *__real_malloc(size_t size);
+extern "C" void __real_free(void *p);
+
+static size_t size_class(size_t size) {
+  size /= HEAP_HEADER;
+  return (size < SIZE_CLASSES) ? size : SIZE_CLASSES - 1;
+}
+
+extern "C" void *__wrap_malloc(size_t len) {
+  struct heap_block **best = NULL, *b;
+  size_t size = (len + HEAP_HEADER - 1) / HEAP_HEADER * HEAP_HEADER;
+
+  if (size < sizeof(struct heap_block) - HEAP_HEADER)
+    size = sizeof(struct heap_block) - HEAP_HEADER;
+  for (struct heap_block **p = &heap_free; *p != NULL; p = &(*p)->next) {
+    if ((*p)->size == size) {
+      best = p;
+      break;
+    }
+    if ((*p)->size > size && (best == NULL || (*p)->size < (*best)->size))
+      best = p;
+  }
+  if (best != NULL) {
+    b = *best;
+    if (b->size - size >= sizeof(struct heap_block)) {
+      // Split, the top of the block is handed out.
+      b->size -= size + HEAP_HEADER;
+      b = (struct heap_block *)((unsigned char *)b + HEAP_HEADER + b->size);
+      b->size = size;
+    } else {
+      *best = b->next;
+    }
+  } else if (heap_top + HEAP_HEADER + size <= heap_size) {
+    b = (struct heap_block *)&heap[heap_top];
+    b->size = size;
+    heap_top += HEAP_HEADER + size;
+  } else {
+    heap_failed++;
+    return NULL;
+  }
+  heap_allocs++;
+  heap_live++;
+  class_allocs[size_class(b->size)]++;
+  class_live[size_class(b->size)]++;
+  return (unsigned char *)b + HEAP_HEADER;
+}
+
+extern "C" void __wrap_free(void *p) {
+  struct heap_block *b, **at = &heap_free, *prev = NULL;
+
+  if (p == NULL)
+    return;
+  if ((unsigned char *)p < heap || (unsigned char *)p >= heap + HEAP_MAX) {
+    __real_free(p);
+    return;
+  }
+  b = (struct heap_block *)((unsigned char *)p - HEAP_HEADER);
+  heap_frees++;
+  heap_live--;
+  class_live[size_class(b->size)]--;
+
+  // Insert in address order, merging with the neighbours.
+  while (*at != NULL && *at < b) {
+    prev = *at;
+    at = &(*at)->next;
+  }
+  b->next = *at;
+  *at = b;
+  if (b->next != NULL
+      && (unsigned char *)b + HEAP_HEADER + b->size == (unsigned char *)b->next) {
+    b->size += HEAP_HEADER + b->next->size;
+    b->next = b->next->next;
+  }
+  if (prev != NULL
+      && (unsigned char *)prev + HEAP_HEADER + prev->size == (unsigned char *)b) {
+    prev->size += HEAP_HEADER + b->size;
+    prev->next = b->next;
+    b = prev;
+  }
+  // A free block at the top, the last one, goes back to the heap.
+  if ((unsigned char *)b + HEAP_HEADER + b->size == &heap[heap_top]) {
+    at = &heap_free;
+    while (*at != b)
+      at = &(*at)->next;
+    *at = NULL;
+    heap_top = (unsigned char *)b - heap;
+  }
+}
+
+// Free bytes, i.e. above the top and in free blocks, and the largest
+// allocation that could be made.
+static void heap_state(size_t *free_bytes, size_t *largest) {
+  size_t room = heap_size - heap_top;
+
+  *free_bytes = room;
+  *largest = (room > HEAP_HEADER) ? room - HEAP_HEADER : 0;
+  for (struct heap_block *b = heap_free; b != NULL; b = b->next) {
+    *free_bytes += HEAP_HEADER + b->size;
+    if (b->size > *largest)
+      *largest = b->size;
+  }
+}
+
+/*
+ * Transport
+ */
+
+SoakOut SoakOutput;
+struct soak_conn *soak_current = NULL;
+boolean soak_new = false;
+
+void SoakOut::print(const char *s) {
+  while (*s)
+    print(*s++);
+}
+
+void SoakOut::print(char c) {
+  if (len < SOAK_OUT_LEN) {
+    data[len++] = c;
+    data[len] = '\0';
+  } else {
+    overflow = true;
+  }
+}
+
+void SoakOut::println(const char *s) {
+  print(s);
+  print('\n');
+}
+
+void SoakOut::println(char c) {
+  print(c);
+  print('\n');
+}
+
+void SoakOut::println() {
+  print('\n');
+}
+
+SoakGetRequest::SoakGetRequest(uint8_t *ip, uint16_t port,
+                               const char *hostName, const char *URL) {
+  memcpy(this->ipAddr, ip, 4);
+  this->port = port;
+  this->hostName = hostName;
+  this->URL = URL;
+  this->returnFunc = NULL;
+  this->body = NULL;
+  this->active = false;
+  this->due = 0;
+  this->ok = false;
+}
+
+SoakPostRequest::SoakPostRequest(uint8_t *ip, uint16_t port,
+                                 const char *hostName, const char *URL,
+                                 soak_body_func body)
+  : SoakGetRequest(ip, port, hostName, URL) {
+  this->body = body;
+}
+
+void SoakGetRequest::submit() {
+  active = true;
+  soak_submitted(this);
+}
+
+/*
+ * Callback servers
+ */
+
+// What a callback server got: the last value for each path.
+struct collector {
+  unsigned long latency;          // Time to answer (ms).
+  unsigned int fail_rate;         // Answers that are 500, in 1/1000.
+  std::map<std::string, unsigned int> values;
+  unsigned long requests, values_got;
+};
+
+// A request being answered, with the values that it carries.
+struct exchange {
+  SoakGetRequest *r;
+  struct collector *s;
+  std::string payload;
+};
+
+static struct collector collectors[SERVERS + 1];
+static std::vector<struct exchange> exchanges;
+static unsigned long requests_get = 0, requests_post = 0;
+
+void soak_submitted(SoakGetRequest *r) {
+  struct exchange x;
+  int id = r->port - SERVER_PORT;
+
+  x.r = r;
+  x.s = (id >= 1 && id <= SERVERS) ? &collectors[id] : NULL;
+  if (r->body != NULL) {
+    // The body is printed where the responses are, keep those.
+    SoakOut saved = SoakOutput;
+    SoakOutput.reset();
+    r->body();
+    x.payload = SoakOutput.data;
+    SoakOutput = saved;
+    requests_post++;
+  } else {
+    x.payload = std::string(r->URL) + "\n";
+    requests_get++;
+  }
+  if (x.s == NULL || id == DEAD_SERVER) {
+    // Never answers, WiServer gives up after 5 seconds.
+    r->due = millis() + 5000;
+    r->ok = false;
+  } else {
+    r->due = millis() + x.s->latency;
+    r->ok = (unsigned int)(random() % 1000) >= x.s->fail_rate;
+  }
+  exchanges.push_back(x);
+}
+
+// Take the values out of a payload: lines of <path><value>.
+static void server_got(struct collector *s, const std::string &payload) {
+  size_t start = 0, end;
+
+  while ((end = payload.find('\n', start)) != std::string::npos) {
+    std::string line = payload.substr(start, end - start);
+    size_t slash = line.rfind('/');
+    if (slash != std::string::npos) {
+      s->values[line.substr(0, slash + 1)] = atoi(line.c_str() + slash + 1);
+      s->values_got++;
+    }
+    start = end + 1;
+  }
+  s->requests++;
+}
+
+// End the callback requests that are due.
+static void servers_answer() {
+  unsigned long now = millis();
+
+  for (size_t i=0; i<exchanges.size(); ) {
+    struct exchange x = exchanges[i];
+    if ((long)(now - x.r->due) < 0) {
+      i++;
+      continue;
+    }
+    exchanges.erase(exchanges.begin() + i);
+    if (x.s != NULL && x.r->due != 0 && x.r->ok) {
+      char ok[] = "HTTP/1.0 200 OK\r\n\r\n";
+      server_got(x.s, x.payload);
+      if (x.r->returnFunc) x.r->returnFunc(ok, strlen(ok));
+    } else if (x.s != NULL && x.s != &collectors[DEAD_SERVER]) {
+      char failed[] = "HTTP/1.0 500 Internal Server Error\r\n\r\n";
+      if (x.r->returnFunc) x.r->returnFunc(failed, strlen(failed));
+    }
+    x.r->active = false;
+    if (x.r->returnFunc) x.r->returnFunc(NULL, 0);
+  }
+}
+
+/*
+ * Board
+ */
+
+// Inputs: digital pins 3 to 9 are square waves of various periods, pin
+// 9 toggling at random, and the analogue pins slow sine waves with
+// some noise.  Pin 6 is left for apin_write, and port C for the port
+// writes, see below.
+static const uint8_t wave_pins[] = { 3, 4, 5, 7, 8 };
+static const unsigned long wave_periods[] = { 500, 2000, 10000, 60000, 600000 };
+
+static void board_inputs(unsigned long now) {
+  for (uint8_t i=0; i<sizeof(wave_pins); i++)
+    rest_posix_input(wave_pins[i], (now / (wave_periods[i] / 2)) % 2);
+  if (random() % 100 == 0)
+    rest_posix_input(9, random() % 2);
+  for (uint8_t a=0; a<6; a++) {
+    double v = 512 + 400 * sin(now / (60000.0 * (a + 1)));
+    rest_posix_analog(a, (int)v + random() % 8);
+  }
+}
+
+// Port C is all outputs: the port writes are checked against what is
+// then read from the pins.
+static unsigned long port_writes = 0, port_mismatches = 0;
+
+static void check_port_write(unsigned int mask, unsigned int value,
+                             uint8_t before) {
+  uint8_t after = 0;
+
+  for (uint8_t bit=0; bit<6; bit++)
+    after |= digitalRead(14 + bit) << bit;
+  port_writes++;
+  if (after != (uint8_t)((before & ~mask) | (value & mask)))
+    port_mismatches++;
+}
+
+/*
+ * Clients
+ */
+
+// A connection asking for its response, one segment per tick.
+struct client {
+  struct soak_conn conn;
+  std::string path;               // Request, without the leading /.
+  std::string first;              // Response to the first call.
+  unsigned int segments;          // Segments left to ask for.
+  unsigned long reshapes;         // Value of reshapes on the first call.
+};
+
+static struct client clients[CONNS];
+static std::vector<unsigned int> first_times, later_times, loop_times;
+static unsigned long responses = 0, busy = 0, refused = 0;
+static unsigned long inconsistent = 0, reshaped = 0, truncated = 0;
+static unsigned long reshapes = 0;  // Subscriptions added or removed.
+
+static unsigned long long now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Call the page function for a connection, as WiServer does, and return
+// the response.  The path is parsed in place, hence the copy.
+static std::string call(struct client *c, boolean fresh) {
+  char url[256];
+  unsigned long long start;
+
+  snprintf(url, sizeof(url), "/%s", c->path.c_str());
+  SoakOutput.reset();
+  soak_current = &c->conn;
+  soak_new = fresh;
+  start = now_ns();
+  rest.handleURL(url);
+  (fresh ? first_times : later_times).push_back((now_ns() - start) / 1000);
+  soak_current = NULL;
+  if (SoakOutput.overflow)
+    truncated++;
+  return SoakOutput.data;
+}
+
+// Active subscriptions, with the value that they had when made: the
+// server does not get a value that has not changed since.
+struct subscription {
+  int type, position, server;
+  unsigned int value;
+};
+static std::map<std::string, struct subscription> subscriptions;
+static unsigned int shared[16];
+
+static std::string sub_path(int type, int position, int server) {
+  char path[32];
+  snprintf(path, sizeof(path), "/s%d/%c%d/", server, "daes"[type], position);
+  return path;
+}
+
+static unsigned int current_value(int type, int position) {
+  switch (type) {
+    case 0: return digitalRead(position);
+    case 1: return analogRead(position);
+    case 2: return EEPROM.read(position);
+    default: return shared[position];
+  }
+}
+
+// Keep track of what the requests of a connection changed, now that it
+// was answered.
+static unsigned int wait_seq = 0;
+
+static void answered(struct client *c, uint8_t port_before) {
+  const char *r = c->first.c_str();
+  int type, position, server, value, n = 0;
+  unsigned int mask;
+  char p;
+
+  responses++;
+  if (strstr(r, "\"busy\":true") != NULL) {
+    busy++;
+    return;
+  }
+  if (strncmp(r, "{\"result\":true", 14) == 0) {
+    sscanf(c->path.c_str(), "subscribe/%d/%d/%d/%n", &type, &position,
+           &server, &n);
+    if (n > 0 && server >= 1 && server <= SERVERS) {
+      // subscribe <type> <position> <server> <freq> <path>
+      struct subscription s = { type, position, server,
+                                current_value(type, position) };
+      subscriptions[sub_path(type, position, server)] = s;
+      collectors[server].values.erase(sub_path(type, position, server));
+      reshapes++;
+    } else if (sscanf(c->path.c_str(), "unsubscribe/%d/%d/%d", &type,
+                      &position, &server) == 3) {
+      subscriptions.erase(sub_path(type, position, server));
+      reshapes++;
+    } else if (sscanf(c->path.c_str(), "shared_write/%d/%d", &position,
+                      &value) == 2) {
+      shared[position] = value;
+    } else if (sscanf(c->path.c_str(), "dpin_write_mask/%c/%u/%d", &p,
+                      &mask, &value) == 3) {
+      check_port_write(mask, value, port_before);
+    }
+  }
+  if (strncmp(c->path.c_str(), "wait", 4) == 0) {
+    const char *seq = strstr(r, "\"seq\":");
+    while (seq != NULL && strstr(seq + 1, "\"seq\":") != NULL)
+      seq = strstr(seq + 1, "\"seq\":");
+    if (seq != NULL)
+      wait_seq = atoi(seq + 6);
+  }
+}
+
+static uint8_t port_c() {
+  uint8_t v = 0;
+
+  for (uint8_t bit=0; bit<6; bit++)
+    v |= digitalRead(14 + bit) << bit;
+  return v;
+}
+
+// Start a request on a free connection, NULL when there is none.
+static struct client *request(const std::string &path) {
+  for (int i=0; i<CONNS; i++) {
+    struct client *c = &clients[i];
+    if (!c->conn.open) {
+      uint8_t before = port_c();
+      c->conn.open = true;
+      c->conn.ip[3] = 100 + i;
+      c->path = path;
+      c->reshapes = reshapes;
+      c->first = call(c, true);
+      c->segments = (c->first.size() + SEGMENT - 1) / SEGMENT;
+      answered(c, before);
+      // Ask again for the segments left, and once more in a while as
+      // a retransmission.
+      if (c->segments > 0)
+        c->segments--;
+      if (random() % 50 == 0)
+        c->segments++;
+      if (c->segments == 0)
+        c->conn.open = false;
+      return c;
+    }
+  }
+  refused++;
+  return NULL;
+}
+
+// Ask for the next segment of all open connections.
+static void segments() {
+  for (int i=0; i<CONNS; i++) {
+    struct client *c = &clients[i];
+    if (c->conn.open) {
+      if (call(c, false) != c->first) {
+        if (c->reshapes != reshapes)
+          reshaped++;
+        else
+          inconsistent++;
+      }
+      if (--c->segments == 0)
+        c->conn.open = false;
+    }
+  }
+}
+
+// Next request of the synthetic trace.
+static std::string synthetic() {
+  char path[96];
+  int pick = random() % 100;
+  int server = 1 + random() % SERVERS;
+
+  if (pick < 25) {
+    snprintf(path, sizeof(path), "dpin_read/%ld", 3 + random() % 7);
+  } else if (pick < 35) {
+    snprintf(path, sizeof(path), "apin_read/%ld", random() % 6);
+  } else if (pick < 42) {
+    snprintf(path, sizeof(path), "eeprom_read/%ld", random() % 64);
+  } else if (pick < 46) {
+    snprintf(path, sizeof(path), "eeprom_write/%ld/%ld", random() % 64,
+             random() % 256);
+  } else if (pick < 50) {
+    snprintf(path, sizeof(path), "shared_write/%ld/%ld", random() % 16,
+             random() % 1000);
+  } else if (pick < 53) {
+    snprintf(path, sizeof(path), "shared_read");
+  } else if (pick < 63) {
+    snprintf(path, sizeof(path), "wait/%u", wait_seq);
+  } else if (pick < 68) {
+    snprintf(path, sizeof(path), "status/%ld/20", random() % 3 * 10);
+  } else if (pick < 70) {
+    snprintf(path, sizeof(path), "%s", "");
+  } else if (pick < 72) {
+    snprintf(path, sizeof(path), "mem");
+  } else if (pick < 74) {
+    snprintf(path, sizeof(path), "stats");
+  } else if (pick < 84) {
+    // Churn of subscriptions, for the allocations.
+    int type = random() % 4;
+    int position = (type == 0) ? 9 : (type == 1) ? random() % 6
+      : (type == 2) ? random() % 64 : random() % 16;
+    if (random() % 2)
+      snprintf(path, sizeof(path), "subscribe/%d/%d/%d/%ld/%%2Fs%d%%2F%c%d%%2F",
+               type, position, server, 100 + random() % 1000, server,
+               "daes"[type], position);
+    else
+      snprintf(path, sizeof(path), "unsubscribe/%d/%d/%d", type, position,
+               server);
+  } else if (pick < 90) {
+    snprintf(path, sizeof(path), "dpin_write_mask/C/%ld/%ld", random() % 64,
+             random() % 64);
+  } else if (pick < 92) {
+    snprintf(path, sizeof(path), "apin_write/6/%ld", random() % 256);
+  } else {
+    snprintf(path, sizeof(path), "dpin_read/%ld", 3 + random() % 7);
+  }
+  return path;
+}
+
+// The subscriptions that stay for the whole run.
+static void setup_board(int mode) {
+  static const char *setup[] = {
+    "dpin_mode_mask/C/63/0",
+    "subscribe/0/3/1/10/%2Fs1%2Fd3%2F",
+    "subscribe/0/4/2/10/%2Fs2%2Fd4%2F",
+    "subscribe/0/5/3/10/%2Fs3%2Fd5%2F",
+    "subscribe/0/7/4/10/%2Fs4%2Fd7%2F",
+    "subscribe/1/0/1/200:2000/%2Fs1%2Fa0%2F",
+    "subscribe/0/8/8",
+  };
+  char path[64];
+
+  for (int s=1; s<=SERVERS; s++) {
+    snprintf(path, sizeof(path), "server_add/%d/10.0.0.%d/%d/%d", s, 10 + s,
+             SERVER_PORT + s, mode);
+    request(path);
+    while (clients[0].conn.open || clients[1].conn.open
+           || clients[2].conn.open || clients[3].conn.open)
+      segments();
+  }
+  for (size_t i=0; i<sizeof(setup)/sizeof(setup[0]); i++) {
+    request(setup[i]);
+    while (clients[0].conn.open || clients[1].conn.open
+           || clients[2].conn.open || clients[3].conn.open)
+      segments();
+  }
+}
+
+static unsigned int percentile(std::vector<unsigned int> &v, int p) {
+  if (v.empty())
+    return 0;
+  return v[std::min(v.size() - 1, v.size() * p / 100)];
+}
+
+static void print_times(const char *what, std::vector<unsigned int> &v) {
+  std::sort(v.begin(), v.end());
+  printf("  %-22s %9lu calls, p50 %u, p99 %u, max %u\n", what,
+         (unsigned long)v.size(), percentile(v, 50), percentile(v, 99),
+         v.empty() ? 0 : v.back());
+}
+
+static void print_heap(double hours) {
+  size_t free_bytes, largest;
+
+  heap_state(&free_bytes, &largest);
+  printf("  %7.1f %6lu %6lu %7lu %6.1f%% %6lu %9lu %9lu %6lu\n", hours,
+         (unsigned long)(heap_size - free_bytes), (unsigned long)free_bytes,
+         (unsigned long)largest,
+         free_bytes ? 100.0 * (1.0 - (double)largest / free_bytes) : 0.0,
+         heap_live, heap_allocs, heap_frees, heap_failed);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-d hours] [-r requests/s] [-l latency] "
+          "[-m mode] [-H heap] [-s seed] [-t trace] [-e eeprom] [-b]\n", name);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  double hours = 24, rate = 2;
+  unsigned long latency = 50, ticks, tick, every;
+  int mode = 0, opt;
+  const char *trace_file = NULL, *eeprom = NULL;
+  boolean boot = false;
+  FILE *trace = NULL;
+  unsigned long next_request = 0;
+  unsigned long long started;
+
+  srandom(1);
+  while ((opt = getopt(argc, argv, "d:r:l:m:H:s:t:e:b")) != -1) {
+    switch (opt) {
+      case 'd': hours = atof(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'l': latency = atol(optarg); break;
+      case 'm': mode = atoi(optarg); break;
+      case 'H': heap_size = atol(optarg); break;
+      case 's': srandom(atoi(optarg)); break;
+      case 't': trace_file = optarg; break;
+      case 'e': eeprom = optarg; break;
+      case 'b': boot = true; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (heap_size > HEAP_MAX || rate <= 0 || optind != argc)
+    usage(argv[0]);
+  if (trace_file != NULL && (trace = fopen(trace_file, "r")) == NULL) {
+    perror(trace_file);
+    return 1;
+  }
+  if (eeprom != NULL && !rest_posix_eeprom(eeprom)) {
+    perror(eeprom);
+    return 1;
+  }
+
+  for (int s=1; s<=SERVERS; s++) {
+    collectors[s].latency = latency;
+    collectors[s].fail_rate = 0;
+  }
+  collectors[3].latency = latency * 4;       // Slow and flaky.
+  collectors[3].fail_rate = 100;
+  rest_posix_advance(0);
+
+  started = now_ns();
+  rest.init();
+  if (boot) {
+    unsigned long long took = now_ns() - started;
+    printf("init() took %llu us, mem: %s\n", took / 1000,
+           request("mem")->first.c_str());
+    return 0;
+  }
+  setup_board(mode);
+
+  ticks = (unsigned long)(hours * 3600000 / TICK);
+  every = std::max(1UL, ticks / 24 / (3600000 / TICK)) * (3600000 / TICK);
+  printf("heap (%lu bytes):\n     hour   used   free largest   frag   live"
+         "    allocs     frees failed\n", (unsigned long)heap_size);
+  print_heap(0);
+  started = now_ns();
+  for (tick=1; tick<=ticks; tick++) {
+    unsigned long now;
+    unsigned long long start;
+
+    rest_posix_advance(TICK * 1000UL);
+    now = millis();
+    board_inputs(now);
+
+    if ((long)(now - next_request) >= 0) {
+      if (trace != NULL) {
+        char line[256], *path;
+        unsigned long delay;
+        if (fgets(line, sizeof(line), trace) == NULL) {
+          rewind(trace);
+          if (fgets(line, sizeof(line), trace) == NULL)
+            line[0] = '\0';
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        delay = strtoul(line, &path, 10);
+        while (*path == ' ') path++;
+        if (*path == '/') path++;
+        request(path);
+        next_request = now + delay;
+      } else {
+        request(synthetic());
+        next_request = now + (unsigned long)(-log((random() + 1.0)
+                                                  / (RAND_MAX + 2.0))
+                                             * 1000 / rate);
+      }
+    }
+    segments();
+    servers_answer();
+    start = now_ns();
+    rest.loop();
+    loop_times.push_back((now_ns() - start) / 1000);
+
+    if (tick % every == 0 || tick == ticks)
+      print_heap(tick * TICK / 3600000.0);
+  }
+
+  // Let the callbacks settle, with the inputs left as they are.
+  for (tick=0; tick<SETTLE / TICK; tick++) {
+    rest_posix_advance(TICK * 1000UL);
+    segments();
+    servers_answer();
+    rest.loop();
+  }
+
+  printf("\n%.1f simulated hours in %.1f s, %lu requests\n", hours,
+         (now_ns() - started) / 1e9, responses);
+  printf("handling time (us, host):\n");
+  print_times("handleURL(), new", first_times);
+  print_times("handleURL(), segments", later_times);
+  print_times("loop()", loop_times);
+  printf("responses: %lu busy, %lu refused (no connection), %lu truncated, "
+         "%lu inconsistent between segments, %lu changed by a subscribe "
+         "or unsubscribe meanwhile\n", busy, refused, truncated,
+         inconsistent, reshaped);
+  printf("port writes: %lu, %lu mismatches\n", port_writes, port_mismatches);
+
+  unsigned long stale = 0, checked = 0;
+  for (std::map<std::string, struct subscription>::iterator i =
+         subscriptions.begin(); i != subscriptions.end(); i++) {
+    struct subscription &s = i->second;
+    std::map<std::string, unsigned int>::iterator got;
+    unsigned int value = s.value;
+    if (s.server == DEAD_SERVER)
+      continue;
+    got = collectors[s.server].values.find(i->first);
+    if (got != collectors[s.server].values.end())
+      value = got->second;
+    checked++;
+    if (value != current_value(s.type, s.position))
+      stale++;
+  }
+  printf("callbacks: %lu GET and %lu POST requests\n", requests_get,
+         requests_post);
+  for (int s=1; s<=SERVERS; s++)
+    printf("  server %d: %lu requests answered, %lu values (%.2f/s)\n", s,
+           collectors[s].requests, collectors[s].values_got,
+           collectors[s].values_got / (hours * 3600));
+#ifdef HAVE_STATS
+  printf("  library: %lu delivered, %lu failed, %lu dropped (replaced "
+         "before sent)\n", TinyREST::stats.delivered, TinyREST::stats.failed,
+         TinyREST::stats.dropped);
+#endif
+  printf("  %lu of %lu subscriptions without their last value at the end\n",
+         stale, checked);
+
+  printf("allocations by size (bytes: allocs, live):");
+  for (int i=0; i<SIZE_CLASSES; i++)
+    if (class_allocs[i] > 0)
+      printf(" %d: %lu, %lu;", (int)(i * HEAP_HEADER), class_allocs[i],
+             class_live[i]);
+  printf("\n");
+  printf("mem: %s\n", request("mem")->first.c_str());
+  return 0;
+}